@@ -0,0 +1 @@
+#define GIT_VERSION "1.0.0.GIT"
@@ -6,11 +6,20 @@
 #include "g13.hpp"
 #include "g13_device.hpp"
 #include "g13_manager.hpp"
+#include <algorithm>
 
 // *************************************************************************
 namespace G13 {
 G13_Action::~G13_Action() = default;
 
+void G13_Action::act(G13_Device &g13, bool is_down) {
+  auto &stats = g13.stats();
+  auto start = G13_Stats::Now();
+  perform(g13, is_down);
+  stats.action.record(G13_Stats::Now() - start);
+  G13_Stats::count(stats.actions[kind()]);
+}
+
 G13_Action_Keys::G13_Action_Keys(G13_Device &keypad,
                                  const std::string &keys_string)
     : G13_Action(keypad) {
@@ -19,7 +28,8 @@ G13_Action_Keys::G13_Action_Keys(G13_Device &keypad,
     auto keys = Helper::split<std::vector<std::string>>(in, "+");
     for (auto &key : keys) {
       auto kval = G13_Manager::Instance()->FindInputKeyValue(key);
-      if (kval.key() == BAD_KEY_VALUE) {
+      if (kval.key() == BAD_KEY_VALUE ||
+          (size_t)kval.key() >= G13_OUTPUT_KEYS) {
         throw G13_CommandException("create action unknown key : " + key);
       }
       out.push_back(kval);
@@ -31,45 +41,77 @@ G13_Action_Keys::G13_Action_Keys(G13_Device &keypad,
   scan(keydownup[0], _keys);
   if (keydownup.size()>1)
     scan(keydownup[1], _keysup);
-}
-
-G13_Action_Keys::~G13_Action_Keys() = default;
 
-void G13_Action_Keys::act(G13_Device &g13, bool is_down) {
-  auto downkeys = std::vector<bool>(G13_Manager::InputKeyMax(), false);
-
-  auto send_key = [&](LINUX_KEY_VALUE key, bool down) {
-    g13.SendEvent(EV_KEY, key, down);
-    downkeys[key] = down;
-    G13_LOG(log4cpp::Priority::DEBUG << "sending KEY " <<
-            (down? "DOWN ": "UP ") << key);
-  };
-  auto send_keys = [&](std::vector<G13_State_Key> &keys) {
+  // "A+A" types A twice, "-A" releases A no matter which binding holds it
+  auto compile = [](const std::vector<G13_State_Key> &keys,
+                    std::vector<input_event> &out,
+                    std::vector<LINUX_KEY_VALUE> &held) {
+    auto event = [&out](LINUX_KEY_VALUE key, int value) {
+      input_event ev{};
+      ev.type = EV_KEY;
+      ev.code = key;
+      ev.value = value;
+      out.push_back(ev);
+    };
     for (auto &key : keys) {
-      if (key.is_down() && downkeys[key.key()])
-        send_key(key.key(), false);
-      send_key(key.key(), key.is_down());
+      auto pressed = std::find(held.begin(), held.end(), key.key());
+      if (!key.is_down()) {
+        if (pressed != held.end()) {
+          held.erase(pressed);
+          event(key.key(), 0);
+        } else {
+          event(key.key(), G13_KEY_FORCE_UP);
+        }
+      } else if (pressed != held.end()) {
+        event(key.key(), 0);
+        event(key.key(), 1);
+      } else {
+        held.push_back(key.key());
+        event(key.key(), 1);
+      }
     }
   };
-  auto release_keys = [&](std::vector<G13_State_Key> &keys) {
-    for (auto i = keys.size(); i--;)
-      if (downkeys[keys[i].key()])
-        send_key(keys[i].key(), false);
+  auto release = [](std::vector<LINUX_KEY_VALUE> &held,
+                    std::vector<input_event> &out) {
+    for (auto i = held.size(); i--;) {
+      input_event ev{};
+      ev.type = EV_KEY;
+      ev.code = held[i];
+      ev.value = 0;
+      out.push_back(ev);
+    }
+    held.clear();
   };
 
-  if (is_down) {
-    send_keys(_keys);
-    if (!_keysup.empty())
-      release_keys(_keys);
+  std::vector<LINUX_KEY_VALUE> held;
+  compile(_keys, _down_events, held);
+  if (_keysup.empty()) {
+    // keys stay down until the G13 key is released
+    release(held, _up_events);
+  } else {
+    release(held, _down_events);
+    compile(_keysup, _up_events, held);
+    release(held, _up_events);
   }
-  else if(_keysup.empty()) {
-    for (auto &key : _keys)
-      downkeys[key.key()] = key.is_down();
-    release_keys(_keys);
-  }
-  else {
-    send_keys(_keysup);
-    release_keys(_keysup);
+}
+
+G13_Action_Keys::~G13_Action_Keys() = default;
+
+void G13_Action_Keys::perform(G13_Device &g13, bool is_down) {
+  if (is_down) {
+    if (_holding) {
+      // pressed again without a release in between
+      g13.SendKeys(_up_events.data(), _up_events.size());
+    }
+    g13.SendKeys(_down_events.data(), _down_events.size());
+    _holding = _keysup.empty();
+  } else if (_keysup.empty()) {
+    if (_holding) {
+      g13.SendKeys(_up_events.data(), _up_events.size());
+      _holding = false;
+    }
+  } else {
+    g13.SendKeys(_up_events.data(), _up_events.size());
   }
 }
 
@@ -91,7 +133,7 @@ G13_Action_PipeOut::G13_Action_PipeOut(G13_Device &keypad,
 
 G13_Action_PipeOut::~G13_Action_PipeOut() = default;
 
-void G13_Action_PipeOut::act(G13_Device &kp, bool is_down) {
+void G13_Action_PipeOut::perform(G13_Device &kp, bool is_down) {
   if (is_down) {
     kp.OutputPipeWrite(_out);
   }
@@ -102,13 +144,18 @@ void G13_Action_PipeOut::dump(std::ostream &o) const {
 }
 
 G13_Action_Command::G13_Action_Command(G13_Device &keypad, std::string cmd)
-    : G13_Action(keypad), _cmd(std::move(cmd)) {}
+    : G13_Action(keypad), _cmd(std::move(cmd)),
+      _bound(keypad.CompileCommand(_cmd.c_str())) {}
 
 G13_Action_Command::~G13_Action_Command() = default;
 
-void G13_Action_Command::act(G13_Device &kp, bool is_down) {
+void G13_Action_Command::perform(G13_Device &kp, bool is_down) {
   if (is_down) {
-    keypad().Command(_cmd.c_str());
+    try {
+      _bound();
+    } catch (const std::exception &ex) {
+      G13_ERR("command failed : " << ex.what());
+    }
   }
 }
 
@@ -8,7 +8,10 @@
 #include "g13.hpp"
 #include "g13_keys.hpp"
 #include "g13_manager.hpp"
+#include "g13_stats.hpp"
 #include "g13_stick.hpp"
+#include <functional>
+#include <linux/input.h>
 #include <memory>
 #include <vector>
 
@@ -31,8 +34,10 @@ public:
   explicit G13_Action(G13_Device &keypad) : _keypad(keypad) {}
   virtual ~G13_Action();
 
-  virtual void act(G13_Device &, bool is_down) = 0;
+  // instrumented entry point, dispatches to perform()
+  void act(G13_Device &, bool is_down);
   virtual void dump(std::ostream &) const = 0;
+  [[nodiscard]] virtual G13_ActionKind kind() const = 0;
 
   void act(bool is_down) { act(keypad(), is_down); }
 
@@ -43,6 +48,9 @@ public:
 
   // [[nodiscard]] const G13_Manager& manager() const;
 
+protected:
+  virtual void perform(G13_Device &, bool is_down) = 0;
+
 private:
   G13_Device &_keypad;
 };
@@ -57,11 +65,20 @@ public:
   G13_Action_Keys(G13_Device &keypad, const std::string &keys);
   ~G13_Action_Keys() override;
 
-  void act(G13_Device &, bool is_down) override;
   void dump(std::ostream &) const override;
+  [[nodiscard]] G13_ActionKind kind() const override { return ACTION_KEYS; }
 
   std::vector<G13_State_Key> _keys;
   std::vector<G13_State_Key> _keysup;
+
+protected:
+  void perform(G13_Device &, bool is_down) override;
+
+  // input events sent on press and on release, with releases resolved
+  std::vector<input_event> _down_events;
+  std::vector<input_event> _up_events;
+  // true between a key press and release without _keysup
+  bool _holding = false;
 };
 
 /*!
@@ -72,10 +89,13 @@ public:
   G13_Action_PipeOut(G13_Device &keypad, const std::string &out);
   ~G13_Action_PipeOut() override;
 
-  void act(G13_Device &, bool is_down) override;
   void dump(std::ostream &) const override;
+  [[nodiscard]] G13_ActionKind kind() const override { return ACTION_PIPEOUT; }
 
   std::string _out;
+
+protected:
+  void perform(G13_Device &, bool is_down) override;
 };
 
 /*!
@@ -86,10 +106,16 @@ public:
   G13_Action_Command(G13_Device &keypad, std::string cmd);
   ~G13_Action_Command() override;
 
-  void act(G13_Device &, bool is_down) override;
   void dump(std::ostream &) const override;
+  [[nodiscard]] G13_ActionKind kind() const override { return ACTION_COMMAND; }
 
   std::string _cmd;
+
+protected:
+  void perform(G13_Device &, bool is_down) override;
+
+  // _cmd as parsed at bind time
+  std::function<void()> _bound;
 };
 
 // *************************************************************************
@@ -101,8 +127,8 @@ public:
 
   [[nodiscard]] G13_ActionPtr action() const { return _action; }
   [[nodiscard]] const std::string &name() const { return _name; }
-  // PARENT_T& parent() { return *_parent_ptr; }
-  // [[nodiscard]] const PARENT_T& parent() const { return *_parent_ptr; }
+  PARENT_T &parent() { return *_parent_ptr; }
+  [[nodiscard]] const PARENT_T &parent() const { return *_parent_ptr; }
   // G13_Manager& manager() { return _parent_ptr->manager(); }
   // [[nodiscard]] const G13_Manager& manager() const { return
   // _parent_ptr->manager(); }
@@ -126,16 +152,11 @@ public:
   void dump(std::ostream &o) const;
   [[nodiscard]] G13_KEY_INDEX index() const { return _index.index; }
 
-  void ParseKey(const unsigned char *byte, G13_Device *g13);
-
 protected:
   struct KeyIndex {
-    explicit KeyIndex(int key)
-        : index(key), offset(key / 8u), mask(1u << (key % 8u)) {}
+    explicit KeyIndex(int key) : index(key) {}
 
     int index;
-    unsigned char offset;
-    unsigned char mask;
   };
 
   // G13_Profile is the only class able to instantiate G13_Keys
@@ -171,11 +192,39 @@ public:
 
   // void ParseKey(unsigned char* byte, G13_Device* g13);
   void test(const G13_ZoneCoord &loc);
-  void set_bounds(const G13_ZoneBounds &bounds) { _bounds = bounds; }
+
+  // acts on the stick being in the zone or not
+  void update(bool active);
+
+  // false and unchanged when the enter margin would leave nothing to enter
+  bool set_bounds(const G13_ZoneBounds &bounds);
+  void set_action(const G13_ActionPtr &action) override;
+
+  // acting on every report while active, not only on entering
+  void set_repeat(bool repeat);
+  [[nodiscard]] bool repeat() const { return _repeat; }
+
+  /*!
+   * the stick enters the zone enter_margin inside the bounds and leaves it
+   * exit_margin outside, so jitter at an edge does not flip the zone.
+   * Edges at the limits of the stick range are not moved in. Returns false
+   * and changes nothing when enter_margin would leave nothing to enter.
+   */
+  bool set_hysteresis(double enter_margin, double exit_margin);
+
+  // the bounds to enter the zone, and to stay in it
+  [[nodiscard]] G13_ZoneBounds enter_bounds() const;
+  [[nodiscard]] G13_ZoneBounds stay_bounds() const;
+
+  [[nodiscard]] const G13_ZoneBounds &bounds() const { return _bounds; }
+  [[nodiscard]] bool active() const { return _active; }
 
 protected:
   G13_ZoneBounds _bounds;
   bool _active;
+  bool _repeat = false;
+  double _enter_margin = 0.0;
+  double _exit_margin = 0.0;
 };
 
 } // namespace G13
@@ -0,0 +1,300 @@
+//
+// Control socket: a SOCK_SEQPACKET unix socket taking commands for any
+// device from any number of clients and answering each one.
+//
+
+#include "g13_manager.hpp"
+#include "g13_device.hpp"
+#include <climits>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace G13 {
+
+// largest request accepted, one request per message
+static const size_t G13_CONTROL_REQUEST_SIZE = 64 * 1024;
+// replies queued for a client not reading them before it is dropped
+static const size_t G13_CONTROL_MAX_QUEUED = 64;
+
+int G13_Manager::controlSocket = -1;
+std::string G13_Manager::controlSocketName;
+std::map<int, std::deque<std::string>> G13_Manager::controlClients;
+
+/*!
+ * removes a socket left behind by a g13d that is gone, false when the name
+ * is taken by a running one or by something other than a socket
+ */
+static bool RemoveStaleSocket(const sockaddr_un &addr) {
+  struct stat st {};
+  if (lstat(addr.sun_path, &st) < 0) {
+    if (errno == ENOENT)
+      return true;
+    G13_ERR("Cannot use control socket " << addr.sun_path << ": "
+                                         << strerror(errno));
+    return false;
+  }
+  if (!S_ISSOCK(st.st_mode)) {
+    G13_ERR("Cannot use control socket " << addr.sun_path
+                                         << ": exists and is not a socket");
+    return false;
+  }
+
+  int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (probe < 0) {
+    G13_ERR("Cannot check control socket " << addr.sun_path << ": "
+                                           << strerror(errno));
+    return false;
+  }
+  int connected = connect(probe, (const sockaddr *)&addr, sizeof(addr));
+  int error = errno;
+  close(probe);
+  if (connected == 0) {
+    G13_ERR("Control socket " << addr.sun_path
+                              << " is in use by another g13d");
+    return false;
+  }
+  if (error != ECONNREFUSED) {
+    G13_ERR("Cannot use control socket " << addr.sun_path << ": "
+                                         << strerror(error));
+    return false;
+  }
+  if (unlink(addr.sun_path) < 0) {
+    G13_ERR("Cannot remove stale control socket " << addr.sun_path << ": "
+                                                  << strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+bool G13_Manager::InitControlSocket() {
+  std::string socket_name = getStringConfigValue("control_socket");
+  if (socket_name.empty())
+    socket_name = CONTROL_DIR "/g13-control";
+
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (socket_name.size() >= sizeof(addr.sun_path)) {
+    G13_ERR("Control socket name too long: " << socket_name);
+    return false;
+  }
+  strcpy(addr.sun_path, socket_name.c_str());
+  if (!RemoveStaleSocket(addr))
+    return false;
+  controlSocket =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (controlSocket < 0 ||
+      bind(controlSocket, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(controlSocket, 16) < 0) {
+    G13_ERR("Cannot create control socket " << socket_name << ": "
+                                            << strerror(errno));
+    CleanupControlSocket();
+    return false;
+  }
+  controlSocketName = socket_name;
+  mode_t umask = std::stoi("0" + getStringConfigValue("umask"), nullptr, 8);
+  chmod(socket_name.c_str(), 0777 & ~(umask | S_IXUSR | S_IXGRP | S_IXOTH));
+
+  WatchFd(controlSocket, EPOLLIN, [](uint32_t) { ControlAccept(); });
+  G13_OUT("Control socket " << socket_name);
+  return true;
+}
+
+void G13_Manager::CleanupControlSocket() {
+  while (!controlClients.empty()) {
+    ControlDrop(controlClients.begin()->first);
+  }
+  if (controlSocket >= 0) {
+    UnwatchFd(controlSocket);
+    close(controlSocket);
+    controlSocket = -1;
+  }
+  if (!controlSocketName.empty()) {
+    unlink(controlSocketName.c_str());
+    controlSocketName.clear();
+  }
+}
+
+void G13_Manager::ControlAccept() {
+  int client;
+  while ((client = accept4(controlSocket, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    controlClients[client];
+    WatchFd(client, EPOLLIN,
+            [client](uint32_t events) { ControlEvents(client, events); });
+    G13_DBG("control client " << client << " connected");
+  }
+}
+
+void G13_Manager::ControlDrop(int client) {
+  UnwatchFd(client);
+  close(client);
+  controlClients.erase(client);
+  G13_DBG("control client " << client << " disconnected");
+}
+
+void G13_Manager::ControlEvents(int client, uint32_t events) {
+  if (events & EPOLLOUT) {
+    auto &queue = controlClients[client];
+    while (!queue.empty()) {
+      if (send(client, queue.front().data(), queue.front().size(),
+               MSG_NOSIGNAL | MSG_DONTWAIT) < 0) {
+        if (errno != EAGAIN) {
+          ControlDrop(client);
+          return;
+        }
+        break;
+      }
+      queue.pop_front();
+    }
+    if (queue.empty()) {
+      WatchFd(client, EPOLLIN,
+              [client](uint32_t events) { ControlEvents(client, events); });
+    }
+  }
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    ControlDrop(client);
+    return;
+  }
+  if (!(events & EPOLLIN))
+    return;
+
+  static char request[G13_CONTROL_REQUEST_SIZE + 1];
+  ssize_t size = recv(client, request, G13_CONTROL_REQUEST_SIZE, MSG_TRUNC);
+  if (size < 0) {
+    if (errno != EAGAIN)
+      ControlDrop(client);
+    return;
+  }
+  if (size == 0) {
+    ControlDrop(client);
+    return;
+  }
+  if ((size_t)size > G13_CONTROL_REQUEST_SIZE) {
+    ControlReply(client, "ERR request too long\n");
+    return;
+  }
+  // tools like socat end their messages with a newline
+  while (size && (request[size - 1] == '\n' || request[size - 1] == '\r'))
+    size--;
+  request[size] = 0;
+  auto reply = ControlRequest(client, request);
+  if (!reply.empty()) {
+    ControlReply(client, std::move(reply));
+  }
+}
+
+/*!
+ * runs one request and returns its reply, "OK" or "ERR <reason>" on the
+ * first line followed by whatever the command printed. Requests are a
+ * device command, prefixed by "@<id> " for devices other than 0, or
+ * "devices" to list the device ids.
+ *
+ * "subscribe [key] [profile] [out]" hands the client over to the event bus
+ * of the device, the reply is empty then.
+ */
+std::string G13_Manager::ControlRequest(int client, const char *request) {
+  std::ostringstream out;
+  const char *remainder = request;
+  std::string_view word;
+  Helper::advance_ws(remainder, word);
+
+  if (word == "devices") {
+    out << "OK" << std::endl;
+    for (auto g13 : g13s) {
+      out << g13->id_within_manager() << std::endl;
+    }
+    return out.str();
+  }
+
+  int id = 0;
+  if (!word.empty() && word[0] == '@') {
+    std::string number(word.substr(1));
+    char *end;
+    errno = 0;
+    long value = strtol(number.c_str(), &end, 10);
+    if (number.empty() || *end || errno || value < 0 || value > INT_MAX) {
+      return "ERR bad device id " + number + "\n";
+    }
+    id = (int)value;
+  } else {
+    remainder = request;
+  }
+  auto i_g13 = std::find_if(g13s.begin(), g13s.end(), [id](G13_Device *g13) {
+    return g13->id_within_manager() == id;
+  });
+  if (i_g13 == g13s.end()) {
+    return "ERR no device " + std::to_string(id) + "\n";
+  }
+
+  G13_DBG("control request for " << id << ": " << Helper::ltrim(remainder));
+  const char *args = remainder;
+  Helper::advance_ws(args, word);
+  if (word == "subscribe") {
+    return ControlSubscribe(client, **i_g13, args);
+  }
+  try {
+    (*i_g13)->RunCommand(remainder, out);
+  } catch (const std::exception &ex) {
+    return "ERR " + std::string(ex.what()) + "\n" + out.str();
+  }
+  return "OK\n" + out.str();
+}
+
+std::string G13_Manager::ControlSubscribe(int client, G13_Device &g13,
+                                          const char *args) {
+  unsigned mask = 0;
+  std::string_view type;
+  while (Helper::advance_ws(args, type), !type.empty()) {
+    if (type == "key") {
+      mask |= G13_EVENT_KEY;
+    } else if (type == "profile") {
+      mask |= G13_EVENT_PROFILE;
+    } else if (type == "out") {
+      mask |= G13_EVENT_OUT;
+    } else {
+      return "ERR unknown event type " + std::string(type) + "\n";
+    }
+  }
+  if (!controlClients[client].empty()) {
+    return "ERR replies still queued\n";
+  }
+
+  UnwatchFd(client);
+  controlClients.erase(client);
+  auto &subscriber = g13.events().Subscribe(client, mask ? mask : G13_EVENT_ALL,
+                                            true, false, true);
+  subscriber.PushRaw("OK\n");
+  g13.events().Flush();
+  return "";
+}
+
+void G13_Manager::ControlReply(int client, std::string reply) {
+  auto &queue = controlClients[client];
+  if (queue.empty()) {
+    if (send(client, reply.data(), reply.size(),
+             MSG_NOSIGNAL | MSG_DONTWAIT) >= 0)
+      return;
+    if (errno == EMSGSIZE) {
+      ControlReply(client, "ERR reply too long\n");
+      return;
+    }
+    if (errno != EAGAIN) {
+      G13_DBG("control client " << client << ": " << strerror(errno));
+      ControlDrop(client);
+      return;
+    }
+    WatchFd(client, EPOLLIN | EPOLLOUT,
+            [client](uint32_t events) { ControlEvents(client, events); });
+  } else if (queue.size() >= G13_CONTROL_MAX_QUEUED) {
+    G13_ERR("control client " << client << " is not reading its replies");
+    ControlDrop(client);
+    return;
+  }
+  queue.push_back(std::move(reply));
+}
+
+} // namespace G13
@@ -8,10 +8,15 @@
 #include "g13_log.hpp"
 #include "g13_manager.hpp"
 #include "g13_profile.hpp"
+#include "g13_replay.hpp"
 #include "g13_stick.hpp"
+#include <algorithm>
 #include <fstream>
+#include <sstream>
 #include <regex>
 #include <filesystem>
+#include <endian.h>
+#include <sys/epoll.h>
 #include <unistd.h>
 
 namespace G13 {
@@ -19,19 +24,19 @@ namespace G13 {
 
 G13_Device::G13_Device(libusb_device *dev, libusb_context *ctx,
                        libusb_device_handle *handle, int m_id)
-    : m_id_within_manager(m_id), m_ctx(ctx), m_uinput_fid(-1),
-      m_lcd(*this), m_stick(*this), handle(handle), device(dev) {
+    : G13_Device(std::make_unique<G13_LibusbTransport>(dev, ctx, handle),
+                 m_id) {}
+
+G13_Device::G13_Device(std::unique_ptr<G13_Transport> transport, int m_id)
+    : m_id_within_manager(m_id), m_transport(std::move(transport)),
+      m_uinput_fid(-1), m_lcd(*this), m_stick(*this) {
+  m_transport->attach(this);
   m_currentProfile = std::make_shared<G13_Profile>(*this, "default");
   m_profiles["default"] = m_currentProfile;
 
-  for (bool &key : keys) {
-    key = false;
-  }
-
   lcd().image_clear();
 
   InitFonts();
-  InitCommands();
 }
 
 // *************************************************************************
@@ -129,27 +134,86 @@ int G13CreateUinput(G13_Device *g13) {
 // *************************************************************************
 
 void G13_Device::SendEvent(int type, int code, int val) {
-  using Helper::IGUR;
-  memset(&m_event, 0, sizeof(m_event));
-  gettimeofday(&m_event.time, nullptr);
-  m_event.type = type;
-  m_event.code = code;
-  m_event.value = val;
-  IGUR(write(m_uinput_fid, &m_event, sizeof(m_event)));
+  if (m_event_count == G13_EVENT_BATCH_SIZE) {
+    FlushEvents();
+  }
+  auto &event = m_events[m_event_count++];
+  event.type = type;
+  event.code = code;
+  event.value = val;
+}
+
+void G13_Device::SendKeys(const input_event *events, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto code = events[i].code;
+    switch (events[i].value) {
+    case 1:
+      if (m_key_holds[code]++)
+        continue;
+      m_keys_held.set(code);
+      break;
+    case 0:
+      if (!m_key_holds[code] || --m_key_holds[code])
+        continue;
+      m_keys_held.reset(code);
+      break;
+    default: // G13_KEY_FORCE_UP
+      m_key_holds[code] = 0;
+      if (!m_keys_held.test(code))
+        continue;
+      m_keys_held.reset(code);
+      break;
+    }
+    SendEvent(EV_KEY, code, events[i].value == 1);
+  }
+}
+
+void G13_Device::SyncEvents() {
+  // A report that produced nothing needs no SYN_REPORT either
+  if (m_event_count) {
+    SendEvent(EV_SYN, SYN_REPORT, 0);
+    FlushEvents();
+  }
 }
 
-void G13_Device::OutputPipeWrite(const std::string &out) const {
+void G13_Device::FlushEvents() {
   using Helper::IGUR;
-  IGUR(write(m_output_pipe_fid, out.c_str(), out.size()));
+  if (!m_event_count)
+    return;
+  struct timeval now {};
+  gettimeofday(&now, nullptr);
+  for (size_t i = 0; i < m_event_count; i++) {
+    m_events[i].time = now;
+  }
+
+  auto start = G13_Stats::Now();
+  IGUR(write(m_uinput_fid, m_events, m_event_count * sizeof(m_events[0])));
+  auto end = G13_Stats::Now();
+  m_stats.uinput_write.record(end - start);
+  if (m_report_start) {
+    m_stats.latency.record(end - m_report_start);
+  }
+  G13_Stats::count(m_stats.uinput_writes);
+  G13_Stats::count(m_stats.events, m_event_count);
+  m_event_count = 0;
+}
+
+void G13_Device::OutputPipeWrite(const std::string &out) {
+  PublishEvent(G13_EVENT_OUT, out);
+}
+
+void G13_Device::PublishEvent(G13_EventType type, const std::string &text) {
+  m_event_bus.Publish(type, text);
+  if (!m_report_start) {
+    m_event_bus.Flush();
+  }
 }
 
 void G13_Device::SetModeLeds(int leds) {
   unsigned char usb_data[] = {5, 0, 0, 0, 0};
   usb_data[1] = leds;
-  int error = libusb_control_transfer(
-      handle, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, 9, 0x305,
-      0, usb_data, 5, 1000);
-  if (error != 5) {
+  int error = m_transport->SetReport(0x305, usb_data, 5);
+  if (error != LIBUSB_SUCCESS) {
     G13_ERR("Problem setting mode LEDs: " + DescribeLibusbErrorCode(error));
     return;
   }
@@ -162,38 +226,30 @@ void G13_Device::SetKeyColor(int red, int green, int blue) {
   usb_data[2] = green;
   usb_data[3] = blue;
 
-  error = libusb_control_transfer(
-      handle, LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, 9, 0x307,
-      0, usb_data, 5, 1000);
-  if (error != 5) {
+  m_key_color = {red, green, blue};
+  error = m_transport->SetReport(0x307, usb_data, 5);
+  if (error != LIBUSB_SUCCESS) {
     G13_ERR("Problem changing color: " + DescribeLibusbErrorCode(error));
     return;
   }
 }
 
-/*! reads and processes key state report from G13
+/*! processes key state report from G13
  *
  */
-int G13_Device::ReadKeypresses() {
-  unsigned char buffer[G13_REPORT_SIZE];
-  int size = 0;
-  int error =
-      libusb_interrupt_transfer(handle, LIBUSB_ENDPOINT_IN | G13_KEY_ENDPOINT,
-                                buffer, G13_REPORT_SIZE, &size, 100);
-
-  if (error && error != LIBUSB_ERROR_TIMEOUT) {
-    G13_ERR("Error while reading keys: " << DescribeLibusbErrorCode(error));
-    if (error == LIBUSB_ERROR_NO_DEVICE || error == LIBUSB_ERROR_IO) {
-      G13_DBG("Giving libusb a nudge");
-      libusb_handle_events(m_ctx);
-    }
+void G13_Device::ReadKeypresses(const unsigned char *buffer) {
+  m_report_start = G13_Stats::Now();
+  G13_Stats::count(m_stats.reports);
+  if (m_recorder) {
+    m_recorder->Record(m_report_start, buffer);
   }
-  if (size == G13_REPORT_SIZE) {
-    parse_joystick(buffer);
-    m_currentProfile->ParseKeys(buffer);
-    SendEvent(EV_SYN, SYN_REPORT, 0);
-  }
-  return 0;
+  parse_joystick(buffer);
+  m_currentProfile->ParseKeys(buffer);
+  SyncEvents();
+  m_stats.report.record(G13_Stats::Now() - m_report_start);
+  m_report_start = 0;
+  // subscribers only hear about the report once uinput has it
+  m_event_bus.Flush();
 }
 
 void G13_Device::ReadCommandsFromFile(const std::string &filename,
@@ -251,43 +307,123 @@ void G13_Device::ReadConfigFile(const std::string &filename) {
   ReadCommandsFromFile(filename, "  cfg");
 }
 
+/*! runs the complete lines and frames read from the input pipe
+ *
+ * Lines are parsed in place in m_pipe_buffer. A partial line is moved to
+ * the front and completed by the next read; lines longer than the buffer
+ * are dropped. Frame payload still to come is read straight to its
+ * destination.
+ */
 void G13_Device::ReadCommandsFromPipe() {
-  fd_set set;
-  FD_ZERO(&set);
-  FD_SET(m_input_pipe_fid, &set);
-  struct timeval tv {};
-  tv.tv_sec = 0;
-  tv.tv_usec = 0;
-  int ret = select(m_input_pipe_fid + 1, &set, nullptr, nullptr, &tv);
-  if (ret > 0) {
-    auto end = m_input_pipe_fifo.length();
-    char buf[1024 * 1024];
-    memcpy(buf, m_input_pipe_fifo.c_str(), end);
-    ret = read(m_input_pipe_fid, buf + end, sizeof buf - end);
-    G13_LOG(log4cpp::Priority::DEBUG << "read " << ret << " characters");
-
-    if (ret < 0)
-      ; // Read error: should not occur after successful select().
-    else if (ret + end ==
-        960) { // TODO probably image, for now, don't test, just assume image
-      lcd().Image(reinterpret_cast<unsigned char *>(buf), ret + end);
-    } else {
-      size_t beg = 0;
-      for (ret += end; end < (size_t) ret; end++)
-        if (buf[end] == '\r' || buf[end] == '\n') {
-          if (end != beg) {
-            buf[end] = '\0';
-            Command(buf + beg, "command");
-          }
-          beg = end + 1;
-        }
-      m_input_pipe_fifo.clear();
-      if (ret - beg < sizeof buf)   // Drop too long lines.
-        m_input_pipe_fifo = std::string(buf + beg, ret - beg);
+  char *buf = m_pipe_buffer.data();
+
+  if (m_frame_remaining) {
+    auto dest = m_frame_dest ? m_frame_dest : (unsigned char *)buf;
+    auto ret = read(m_input_pipe_fid, dest,
+                    std::min(m_frame_remaining, m_pipe_buffer.size()));
+    if (ret > 0)
+      FrameData(ret);
+    return;
+  }
+
+  auto ret = read(m_input_pipe_fid, buf + m_pipe_fill,
+                  m_pipe_buffer.size() - m_pipe_fill);
+  G13_LOG(log4cpp::Priority::DEBUG << "read " << ret << " characters");
+  if (ret <= 0)
+    return; // Nothing to read, the pipe is non-blocking.
+
+  if (m_bare_images && !m_pipe_fill && !m_pipe_discard &&
+      ret == G13_LCD_BUFFER_SIZE &&
+      memcmp(buf, G13_FRAME_MAGIC, sizeof(G13_FRAME_MAGIC))) {
+    // unframed image, as written by older clients
+    lcd().Image(reinterpret_cast<unsigned char *>(buf), ret);
+    return;
+  }
+
+  size_t end = m_pipe_fill + ret;
+  size_t scanned = m_pipe_fill; // no line end before this
+  size_t beg = 0;
+  while (beg < end) {
+    size_t avail = end - beg;
+    if (!m_pipe_discard && buf[beg] == G13_FRAME_MAGIC[0] &&
+        !memcmp(buf + beg, G13_FRAME_MAGIC,
+                std::min(avail, sizeof(G13_FRAME_MAGIC)))) {
+      if (avail < sizeof(G13_FrameHeader))
+        break; // wait for the rest of the header
+      G13_FrameHeader header{};
+      memcpy(&header, buf + beg, sizeof(header));
+      beg += sizeof(header);
+      StartFrame(header);
+
+      size_t n = std::min(m_frame_remaining, end - beg);
+      if (m_frame_dest)
+        memcpy(m_frame_dest, buf + beg, n);
+      beg += n;
+      FrameData(n);
+      if (m_frame_remaining) {
+        // everything buffered belongs to the frame
+        m_pipe_fill = 0;
+        return;
+      }
+      continue;
+    }
+
+    auto line_end = std::find_if(buf + std::max(beg, scanned), buf + end,
+                                 [](char c) { return c == '\r' || c == '\n'; });
+    if (line_end == buf + end)
+      break;
+    size_t i = line_end - buf;
+    if (m_pipe_discard) {
+      m_pipe_discard = false;
+    } else if (i != beg) {
+      buf[i] = '\0';
+      Command(buf + beg, "command");
     }
+    beg = i + 1;
+  }
+
+  m_pipe_fill = end - beg;
+  if (m_pipe_discard) {
+    // still inside a dropped line
+    m_pipe_fill = 0;
+  } else if (m_pipe_fill == m_pipe_buffer.size()) {
+    G13_ERR("dropping input pipe line longer than " << m_pipe_buffer.size()
+                                                    << " bytes");
+    m_pipe_discard = true;
+    m_pipe_fill = 0;
+  } else if (beg && m_pipe_fill) {
+    memmove(buf, buf + beg, m_pipe_fill);
   }
 }
 
+void G13_Device::StartFrame(const G13_FrameHeader &header) {
+  m_frame_type = header.type;
+  m_frame_remaining = le16toh(header.length);
+  m_frame_dest = nullptr;
+  if (header.type == G13_FRAME_LCD && m_frame_remaining == G13_LCD_BUF_SIZE) {
+    m_frame_dest = m_frame_image;
+  } else {
+    G13_ERR("skipping input pipe frame of type " << (int)header.type
+                                                 << " and length "
+                                                 << m_frame_remaining);
+    m_frame_type = 0;
+  }
+}
+
+void G13_Device::FrameData(size_t n) {
+  m_frame_remaining -= n;
+  if (m_frame_dest)
+    m_frame_dest += n;
+  if (m_frame_remaining)
+    return;
+
+  if (m_frame_type == G13_FRAME_LCD) {
+    lcd().Image(m_frame_image, G13_LCD_BUF_SIZE);
+  }
+  m_frame_type = 0;
+  m_frame_dest = nullptr;
+}
+
 FontPtr G13_Device::SwitchToFont(const std::string &name) {
   FontPtr rv = pFonts[name];
   if (rv) {
@@ -297,7 +433,15 @@ FontPtr G13_Device::SwitchToFont(const std::string &name) {
 }
 
 void G13_Device::SwitchToProfile(const std::string &name) {
-  m_currentProfile = Profile(name);
+  SetCurrentProfile(Profile(name));
+}
+
+void G13_Device::SetCurrentProfile(ProfilePtr profile) {
+  m_currentProfile = std::move(profile);
+  if (m_event_bus.wants(G13_EVENT_PROFILE)) {
+    PublishEvent(G13_EVENT_PROFILE, m_currentProfile->name() + "\n");
+  }
+  m_rgbfx.ProfileChanged(m_currentProfile->name());
 }
 
 std::vector<std::string>
@@ -346,6 +490,14 @@ void G13_Device::Dump(std::ostream &o, int detail) {
   if (detail > 0) {
     o << "STICK" << std::endl;
     stick().dump(o);
+    if (!m_widgets.empty()) {
+      o << "WIDGETS" << std::endl;
+      for (auto &widget : m_widgets) {
+        widget.second->dump(o);
+      }
+    }
+    o << "RGBFX" << std::endl;
+    m_rgbfx.dump(o);
     if (detail == 1) {
       m_currentProfile->dump(o);
     } else {
@@ -356,49 +508,211 @@ void G13_Device::Dump(std::ostream &o, int detail) {
   }
 }
 
-struct commandAdder {
-  commandAdder(G13_Device::CommandFunctionTable &t, const char *name)
-      : _t(t), _name(name) {}
+/*! handlers for the commands in g13_commands
+ *
+ * Handlers get the device, the rest of the command line after the command
+ * name and a stream for their output. They throw G13_CommandException when
+ * the command fails.
+ */
+struct G13_Commands {
+  typedef G13_Device::BOUND_COMMAND BOUND_COMMAND;
 
-  commandAdder(G13_Device::CommandFunctionTable &t, const char *name,
-               G13_Device::COMMAND_FUNCTION f)
-      : _t(t), _name(name) {
-    _t[_name] = std::move(f);
+  static BOUND_COMMAND out(G13_Device &g13, const char *remainder) {
+    return [&g13, text = std::string(remainder)]() {
+      g13.lcd().WriteString(text.c_str());
+    };
   }
 
-  G13_Device::CommandFunctionTable &_t;
-  std::string _name;
+  /*! parses the integer arguments of a drawing command into values
+   *
+   * The first required values must be given, the others keep their
+   * defaults when left out. A last value, if there is one beyond the
+   * required, is taken to be a G13_LcdColor. The others are limited to
+   * G13_LCD_DRAW_LIMIT either way.
+   */
+  static void draw_args(const char *usage, const char *remainder, int *values,
+                        size_t required, size_t total) {
+    size_t count = 0;
+    while (true) {
+      char *end;
+      long value = strtol(remainder, &end, 0);
+      if (end == remainder)
+        break;
+      if (count == total)
+        throw G13_CommandException(std::string("usage: ") + usage);
+      if (value < -G13_LCD_DRAW_LIMIT || value > G13_LCD_DRAW_LIMIT)
+        throw G13_CommandException("drawing values are limited to +-" +
+                                   std::to_string(G13_LCD_DRAW_LIMIT));
+      values[count++] = (int)value;
+      remainder = end;
+    }
+    if (count < required || *Helper::ltrim(remainder, " \t\r\n"))
+      throw G13_CommandException(std::string("usage: ") + usage);
+    if (total > required &&
+        (values[total - 1] < G13_LCD_CLEAR || values[total - 1] > G13_LCD_INVERT))
+      throw G13_CommandException("bad color, use 0 (clear), 1 (set) or 2 "
+                                 "(invert)");
+  }
 
-  commandAdder &operator+=(G13_Device::COMMAND_FUNCTION f) {
-    _t[_name] = std::move(f);
-    return *this;
-  };
-};
+  // circles are drawn point by point, their radius is kept smaller still
+  static void radius_arg(int radius) {
+    if (radius > G13_LCD_RADIUS_LIMIT)
+      throw G13_CommandException("radius is limited to " +
+                                 std::to_string(G13_LCD_RADIUS_LIMIT));
+  }
 
-void G13_Device::InitCommands() {
-  using Helper::advance_ws;
-  using Helper::ltrim;
-  using Helper::glob2regex;
-  // const char *remainder;
+  static BOUND_COMMAND pixel(G13_Device &g13, const char *remainder) {
+    int v[3] = {0, 0, G13_LCD_SET};
+    draw_args("pixel x y [color]", remainder, v, 2, 3);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2]]() {
+      g13.lcd().Pixel(v0, v1, v2);
+    };
+  }
 
-  commandAdder add_out(_command_table, "out", [this](const char *remainder) {
-    lcd().WriteString(remainder);
-  });
+  static BOUND_COMMAND line(G13_Device &g13, const char *remainder) {
+    int v[5] = {0, 0, 0, 0, G13_LCD_SET};
+    draw_args("line x0 y0 x1 y1 [color]", remainder, v, 4, 5);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], v4 = v[4]]() {
+      g13.lcd().Line(v0, v1, v2, v3, v4);
+    };
+  }
 
-  commandAdder add_pos(_command_table, "pos", [this](const char *remainder) {
-    int row, col;
-    if (sscanf(remainder, " %i %i", &row, &col) == 2) {
-      lcd().WritePos(row, col);
+  static BOUND_COMMAND rect(G13_Device &g13, const char *remainder) {
+    int v[5] = {0, 0, 0, 0, G13_LCD_SET};
+    draw_args("rect x y width height [color]", remainder, v, 4, 5);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], v4 = v[4]]() {
+      g13.lcd().Rect(v0, v1, v2, v3, v4, false);
+    };
+  }
+
+  static BOUND_COMMAND fillrect(G13_Device &g13, const char *remainder) {
+    int v[5] = {0, 0, 0, 0, G13_LCD_SET};
+    draw_args("fillrect x y width height [color]", remainder, v, 4, 5);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], v4 = v[4]]() {
+      g13.lcd().Rect(v0, v1, v2, v3, v4, true);
+    };
+  }
+
+  static BOUND_COMMAND circle(G13_Device &g13, const char *remainder) {
+    int v[4] = {0, 0, 0, G13_LCD_SET};
+    draw_args("circle x y radius [color]", remainder, v, 3, 4);
+    radius_arg(v[2]);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3]]() {
+      g13.lcd().Circle(v0, v1, v2, v3, false);
+    };
+  }
+
+  static BOUND_COMMAND fillcircle(G13_Device &g13, const char *remainder) {
+    int v[4] = {0, 0, 0, G13_LCD_SET};
+    draw_args("fillcircle x y radius [color]", remainder, v, 3, 4);
+    radius_arg(v[2]);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3]]() {
+      g13.lcd().Circle(v0, v1, v2, v3, true);
+    };
+  }
+
+  static BOUND_COMMAND arc(G13_Device &g13, const char *remainder) {
+    int v[6] = {0, 0, 0, 0, 0, G13_LCD_SET};
+    draw_args("arc x y radius start end [color]", remainder, v, 5, 6);
+    radius_arg(v[2]);
+    return [&g13, v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3], v4 = v[4],
+            v5 = v[5]]() { g13.lcd().Arc(v0, v1, v2, v3, v4, v5); };
+  }
+
+  static void image(G13_Device &g13, const char *remainder, std::ostream &) {
+    std::string name, filename;
+    Helper::advance_ws(remainder, name);
+    Helper::advance_ws(remainder, filename);
+    if (name.empty() || filename.empty()) {
+      throw G13_CommandException("usage: image name file");
+    }
+    // assigned in place, blits bound to the old image see the new one
+    g13.lcd().images[name] = G13_LcdImage::Load(filename);
+  }
+
+  static BOUND_COMMAND blit(G13_Device &g13, const char *remainder) {
+    std::string name, mode;
+    int x, y, consumed = 0;
+    Helper::advance_ws(remainder, name);
+    if (sscanf(remainder, " %i %i %n", &x, &y, &consumed) != 2 || !consumed) {
+      throw G13_CommandException("usage: blit name x y [copy|or|xor]");
+    }
+    remainder += consumed;
+    Helper::advance_ws(remainder, mode);
+    G13_LcdBlit blit_mode;
+    if (mode.empty() || mode == "copy") {
+      blit_mode = G13_BLIT_COPY;
+    } else if (mode == "or") {
+      blit_mode = G13_BLIT_OR;
+    } else if (mode == "xor") {
+      blit_mode = G13_BLIT_XOR;
     } else {
-      G13_ERR("bad pos : " << remainder);
+      throw G13_CommandException("unknown blit mode : " + mode);
+    }
+    auto image = g13.lcd().images.find(name);
+    if (image == g13.lcd().images.end()) {
+      throw G13_CommandException("unknown image : " + name);
     }
-  });
+    return [&g13, &image = image->second, x, y, blit_mode]() {
+      g13.lcd().Blit(image, x, y, blit_mode);
+    };
+  }
 
-  commandAdder add_bind(_command_table, "bind", [this](const char *remainder) {
+  static void widget(G13_Device &g13, const char *remainder,
+                     std::ostream &) {
+    std::string operation, name, type;
+    Helper::advance_ws(remainder, operation);
+    Helper::advance_ws(remainder, name);
+    if (operation == "add") {
+      int x, y, consumed = 0;
+      Helper::advance_ws(remainder, type);
+      if (name.empty() ||
+          sscanf(remainder, " %i %i%n", &x, &y, &consumed) != 2) {
+        throw G13_CommandException("usage: widget add name type x y [args]");
+      }
+      auto widget = G13_Widget::Make(g13, name, type, x, y,
+                                     remainder + consumed);
+      auto &slot = g13.m_widgets[name];
+      if (slot)
+        slot->Erase();
+      slot = std::move(widget);
+      if (g13.m_widget_timer < 0) {
+        g13.m_widget_timer = G13_Manager::AddTimer(
+            G13_WIDGET_TICK_MS, [&g13]() { g13.WidgetTick(); });
+      }
+      g13.WidgetTick();
+    } else if (operation == "del") {
+      auto widget = g13.m_widgets.find(name);
+      if (widget == g13.m_widgets.end()) {
+        throw G13_CommandException("unknown widget : " + name);
+      }
+      widget->second->Erase();
+      g13.m_widgets.erase(widget);
+      if (g13.m_widgets.empty()) {
+        G13_Manager::RemoveTimer(g13.m_widget_timer);
+        g13.m_widget_timer = -1;
+      }
+      g13.lcd().image_send();
+    } else {
+      throw G13_CommandException("unknown widget operation: <" + operation +
+                                 ">");
+    }
+  }
+
+  static void pos(G13_Device &g13, const char *remainder, std::ostream &) {
+    int row, col;
+    if (sscanf(remainder, " %i %i", &row, &col) != 2) {
+      throw G13_CommandException("bad pos : " + std::string(remainder));
+    }
+    g13.lcd().WritePos(row, col);
+  }
+
+  static void bind(G13_Device &g13, const char *remainder, std::ostream &) {
+    using Helper::advance_ws;
     const char *rawaction;
     std::string keyname, action, actionup;
     advance_ws(remainder, keyname);
-    rawaction = ltrim(remainder);
+    rawaction = Helper::ltrim(remainder);
     advance_ws(remainder, action);
     advance_ws(remainder, actionup);
     if (!action.empty() && strchr("!>", action[0]))
@@ -406,204 +720,484 @@ void G13_Device::InitCommands() {
     else if (!actionup.empty())
       action += std::string(" ") + actionup;
     try {
-      if (auto key = m_currentProfile->FindKey(keyname)) {
-        key->set_action(MakeAction(action));
-      } else if (auto stick_key = m_stick.zone(keyname)) {
-        stick_key->set_action(MakeAction(action));
+      if (auto key = g13.m_currentProfile->FindKey(keyname)) {
+        key->set_action(g13.MakeAction(action));
+      } else if (auto stick_key = g13.m_stick.zone(keyname)) {
+        stick_key->set_action(g13.MakeAction(action));
       } else {
-        G13_ERR("bind key " << keyname << " unknown");
-        return;
+        throw G13_CommandException("bind key " + keyname + " unknown");
       }
       G13_LOG(log4cpp::Priority::DEBUG << "bind " << keyname << " [" << action
                                        << "]");
+    } catch (const G13_CommandException &) {
+      throw;
     } catch (const std::exception &ex) {
-      G13_ERR("bind " << keyname << " " << action << " failed : " << ex.what());
+      throw G13_CommandException("bind " + keyname + " " + action +
+                                 " failed : " + ex.what());
+    }
+  }
+
+  static BOUND_COMMAND profile(G13_Device &g13, const char *remainder) {
+    std::string name;
+    Helper::advance_ws(remainder, name);
+    // the profile is looked up by name only when it does not exist yet
+    // or profiles have been deleted since
+    auto it = g13.m_profiles.find(name);
+    std::weak_ptr<G13_Profile> cached;
+    if (it != g13.m_profiles.end())
+      cached = it->second;
+    return [&g13, name, cached,
+            generation = g13.m_profiles_generation]() mutable {
+      auto profile = cached.lock();
+      if (!profile || generation != g13.m_profiles_generation) {
+        profile = g13.Profile(name);
+        cached = profile;
+        generation = g13.m_profiles_generation;
+      }
+      g13.SetCurrentProfile(profile);
+    };
+  }
+
+  static BOUND_COMMAND font(G13_Device &g13, const char *remainder) {
+    std::string name;
+    Helper::advance_ws(remainder, name);
+    auto font = g13.pFonts.find(name);
+    if (font == g13.pFonts.end()) {
+      throw G13_CommandException("unknown font : " + name);
     }
-  });
-
-  commandAdder add_profile(
-      _command_table, "profile", [this](const char *remainder) {
-        std::string profile;
-        advance_ws(remainder, profile);
-        SwitchToProfile(profile.c_str());
-      });
-
-  commandAdder add_font(_command_table, "font", [this](const char *remainder) {
-    std::string font;
-    advance_ws(remainder, font);
-    SwitchToFont(font.c_str());
-  });
-
-  commandAdder add_mod(_command_table, "mod", [this](const char *remainder) {
-    SetModeLeds(atoi(remainder));
-  });
-
-  commandAdder add_textmode(
-      _command_table, "textmode",
-      [this](const char *remainder) { lcd().text_mode = atoi(remainder); });
-
-  commandAdder add_rgb(_command_table, "rgb", [this](const char *remainder) {
+    return [&g13, font = font->second]() { g13.m_currentFont = font; };
+  }
+
+  static BOUND_COMMAND mod(G13_Device &g13, const char *remainder) {
+    return [&g13, leds = atoi(remainder)]() { g13.SetModeLeds(leds); };
+  }
+
+  static BOUND_COMMAND textmode(G13_Device &g13, const char *remainder) {
+    return [&g13, mode = atoi(remainder)]() { g13.lcd().text_mode = mode; };
+  }
+
+  static BOUND_COMMAND rgb(G13_Device &g13, const char *remainder) {
     int red, green, blue;
-    if (sscanf(remainder, " %i %i %i", &red, &green, &blue) == 3) {
-      SetKeyColor(red, green, blue);
-    } else {
-      G13_ERR("rgb bad format: <" << remainder << ">");
+    if (sscanf(remainder, " %i %i %i", &red, &green, &blue) != 3) {
+      throw G13_CommandException("rgb bad format: <" + std::string(remainder) +
+                                 ">");
+    }
+    return [&g13, red, green, blue]() {
+      g13.m_rgbfx.Stop();
+      g13.SetKeyColor(red, green, blue);
+    };
+  }
+
+  static G13_Color rgbfx_color(const char *&remainder) {
+    G13_Color color{};
+    int consumed = 0;
+    if (sscanf(remainder, " %i %i %i%n", &color.red, &color.green,
+               &color.blue, &consumed) != 3) {
+      throw G13_CommandException("rgbfx bad color: <" +
+                                 std::string(remainder) + ">");
+    }
+    for (int value : {color.red, color.green, color.blue}) {
+      if (value < 0 || value > 255) {
+        throw G13_CommandException("rgbfx color out of range: <" +
+                                   std::string(remainder) + ">");
+      }
+    }
+    remainder += consumed;
+    return color;
+  }
+
+  // reads an optional duration up to G13_RGBFX_MAX_MS, positive unless
+  // zero is allowed
+  static unsigned rgbfx_ms(const char *&remainder, unsigned preset,
+                           bool zero = false) {
+    std::string value;
+    Helper::advance_ws(remainder, value);
+    if (value.empty())
+      return preset;
+    char *end;
+    errno = 0;
+    long ms = strtol(value.c_str(), &end, 10);
+    if (*end || errno || ms < (zero ? 0 : 1) || ms > (long)G13_RGBFX_MAX_MS) {
+      throw G13_CommandException("rgbfx bad duration: <" + value + ">");
     }
-  });
-
-  commandAdder add_stickmode(
-      _command_table, "stickmode", [this](const char *remainder) {
-        std::string mode;
-        advance_ws(remainder, mode);
-        // TODO: this could be part of a G13::Constants class I think
-        const std::string modes[] = {"ABSOLUTE",  "KEYS",
-                                     "CALCENTER", "CALBOUNDS",
-                                     "CALNORTH"};
-        int index = 0;
-        for (auto &test : modes) {
-          if (test == mode) {
-            m_stick.set_mode((G13::stick_mode_t)index);
-            return;
-          }
-          index++;
+    return (unsigned)ms;
+  }
+
+  // reads the steps per second of "rgbfx rate", 1 to 1000
+  static unsigned rgbfx_rate(const char *remainder) {
+    std::string value;
+    Helper::advance_ws(remainder, value);
+    if (value.empty())
+      return G13_RGBFX_DEFAULT_RATE;
+    char *end;
+    errno = 0;
+    long rate = strtol(value.c_str(), &end, 10);
+    if (*end || errno || rate < 1 || rate > 1000) {
+      throw G13_CommandException("rgbfx rate must be 1 to 1000: <" + value +
+                                 ">");
+    }
+    return (unsigned)rate;
+  }
+
+  static BOUND_COMMAND rgbfx(G13_Device &g13, const char *remainder) {
+    std::string operation;
+    Helper::advance_ws(remainder, operation);
+    auto &fx = g13.m_rgbfx;
+    if (operation == "breathe") {
+      auto color = rgbfx_color(remainder);
+      auto period = rgbfx_ms(remainder, 2000);
+      return [&fx, color, period]() { fx.Breathe(color, period); };
+    } else if (operation == "fade") {
+      auto color = rgbfx_color(remainder);
+      auto duration = rgbfx_ms(remainder, 1000, true);
+      return [&fx, color, duration]() { fx.Fade(color, duration); };
+    } else if (operation == "blink") {
+      auto color = rgbfx_color(remainder);
+      auto on = rgbfx_ms(remainder, 500);
+      auto off = rgbfx_ms(remainder, on, true);
+      return [&fx, color, on, off]() { fx.Blink(color, on, off); };
+    } else if (operation == "profile") {
+      std::string name;
+      Helper::advance_ws(remainder, name);
+      if (name.empty()) {
+        throw G13_CommandException("rgbfx profile needs a profile name");
+      }
+      if (std::string(Helper::ltrim(remainder)) == "off") {
+        return [&fx, name]() { fx.ClearProfileColor(name); };
+      }
+      auto color = rgbfx_color(remainder);
+      auto duration = rgbfx_ms(remainder, 500, true);
+      return [&fx, name, color, duration]() {
+        fx.SetProfileColor(name, color, duration);
+      };
+    } else if (operation == "rate") {
+      auto rate = rgbfx_rate(remainder);
+      return [&fx, rate]() { fx.SetRate(rate); };
+    } else if (operation == "stop") {
+      return [&fx]() { fx.Stop(); };
+    }
+    throw G13_CommandException("unknown rgbfx operation: <" + operation +
+                               ">");
+  }
+
+  static void stickdeadzone(G13_Device &g13, const char *remainder,
+                            std::ostream &) {
+    double radius;
+    if (sscanf(remainder, " %lf", &radius) != 1 || radius < 0.0) {
+      throw G13_CommandException("bad deadzone : " + std::string(remainder));
+    }
+    g13.m_stick.set_deadzone(radius);
+  }
+
+  static void stickmode(G13_Device &g13, const char *remainder,
+                        std::ostream &) {
+    std::string mode;
+    Helper::advance_ws(remainder, mode);
+    // TODO: this could be part of a G13::Constants class I think
+    const std::string modes[] = {"ABSOLUTE",  "KEYS",
+                                 "CALCENTER", "CALBOUNDS",
+                                 "CALNORTH"};
+    int index = 0;
+    for (auto &test : modes) {
+      if (test == mode) {
+        g13.m_stick.set_mode((G13::stick_mode_t)index);
+        return;
+      }
+      index++;
+    }
+    throw G13_CommandException("unknown stick mode : <" + mode + ">");
+  }
+
+  static void stickzone(G13_Device &g13, const char *remainder,
+                        std::ostream &) {
+    std::string operation, zonename;
+    Helper::advance_ws(remainder, operation);
+    Helper::advance_ws(remainder, zonename);
+    if (operation == "add") {
+      /* G13_StickZone* zone = */
+      g13.m_stick.zone(zonename, true);
+    } else {
+      G13_StickZone *zone = g13.m_stick.zone(zonename);
+      if (!zone) {
+        throw G13_CommandException("unknown stick zone");
+      }
+      if (operation == "action") {
+        zone->set_action(g13.MakeAction(remainder));
+      } else if (operation == "bounds") {
+        double x1, y1, x2, y2;
+        if (sscanf(remainder,
+                   " %lf %lf %lf %lf", &x1, &y1, &x2, &y2) != 4) {
+          throw G13_CommandException("bad bounds format");
         }
-        G13_ERR("unknown stick mode : <" << mode << ">");
-      });
-
-  commandAdder add_stickzone(
-      _command_table, "stickzone", [this](const char *remainder) {
-        std::string operation, zonename;
-        advance_ws(remainder, operation);
-        advance_ws(remainder, zonename);
-        if (operation == "add") {
-          /* G13_StickZone* zone = */
-          m_stick.zone(zonename, true);
-        } else {
-          G13_StickZone *zone = m_stick.zone(zonename);
-          if (!zone) {
-            throw G13_CommandException("unknown stick zone");
-          }
-          if (operation == "action") {
-            zone->set_action(MakeAction(remainder));
-          } else if (operation == "bounds") {
-            double x1, y1, x2, y2;
-            if (sscanf(remainder,
-                       " %lf %lf %lf %lf", &x1, &y1, &x2, &y2) != 4) {
-              throw G13_CommandException("bad bounds format");
-            }
-            zone->set_bounds(G13_ZoneBounds(x1, y1, x2, y2));
-
-          } else if (operation == "del") {
-            m_stick.RemoveZone(*zone);
-          } else {
-            G13_ERR("unknown stickzone operation: <" << operation << ">");
-          }
+        if (!zone->set_bounds(G13_ZoneBounds(x1, y1, x2, y2))) {
+          throw G13_CommandException("bounds too small for the enter margin");
         }
-      });
+      } else if (operation == "repeat") {
+        std::string repeat;
+        Helper::advance_ws(remainder, repeat);
+        if (repeat != "on" && repeat != "off") {
+          throw G13_CommandException("stickzone repeat needs on or off");
+        }
+        zone->set_repeat(repeat == "on");
+      } else if (operation == "hysteresis") {
+        double enter_margin, exit_margin;
+        if (sscanf(remainder, " %lf %lf", &enter_margin, &exit_margin) != 2 ||
+            enter_margin < 0.0 || exit_margin < 0.0) {
+          throw G13_CommandException("bad hysteresis format");
+        }
+        if (!zone->set_hysteresis(enter_margin, exit_margin)) {
+          throw G13_CommandException("enter margin leaves nothing to enter");
+        }
+      } else if (operation == "del") {
+        g13.m_stick.RemoveZone(*zone);
+      } else {
+        throw G13_CommandException("unknown stickzone operation: <" +
+                                   operation + ">");
+      }
+    }
+  }
 
-  commandAdder add_dump(_command_table, "dump", [this](const char *remainder) {
+  static void dump(G13_Device &g13, const char *remainder, std::ostream &out) {
     std::string target;
-    advance_ws(remainder, target);
+    Helper::advance_ws(remainder, target);
     if (target == "all") {
-      Dump(std::cout, 3);
+      g13.Dump(out, 3);
     } else if (target == "current") {
-      Dump(std::cout, 1);
+      g13.Dump(out, 1);
     } else if (target == "summary") {
-      Dump(std::cout, 0);
+      g13.Dump(out, 0);
+    } else {
+      throw G13_CommandException("unknown dump target: <" + target + ">");
+    }
+  }
+
+  static void stats(G13_Device &g13, const char *remainder,
+                    std::ostream &out) {
+    std::string target;
+    Helper::advance_ws(remainder, target);
+    if (target.empty()) {
+      out << "G13 id=" << g13.id_within_manager() << " stats" << std::endl;
+      g13.m_stats.dump(out);
+      g13.m_event_bus.dump(out);
+    } else if (target == "pipe") {
+      std::ostringstream o;
+      o << "G13 id=" << g13.id_within_manager() << " stats" << std::endl;
+      g13.m_stats.dump(o);
+      g13.m_event_bus.dump(o);
+      g13.OutputPipeWrite(o.str());
+    } else if (target == "reset") {
+      g13.m_stats.reset();
     } else {
-      G13_ERR("unknown dump target: <" << target << ">");
+      throw G13_CommandException("unknown stats target: <" + target + ">");
+    }
+  }
+
+  static void record(G13_Device &g13, const char *remainder, std::ostream &) {
+    std::string target;
+    Helper::advance_ws(remainder, target);
+    if (target.empty()) {
+      throw G13_CommandException("record needs a file name or stop");
+    } else if (target == "stop") {
+      g13.m_recorder.reset();
+    } else {
+      g13.m_recorder = std::make_unique<G13_Recorder>();
+      if (!g13.m_recorder->Start(target)) {
+        g13.m_recorder.reset();
+        throw G13_CommandException("cannot record to " + target);
+      }
     }
-  });
-
-  commandAdder add_log_level(_command_table, "log_level",
-                             [this](const char *remainder) {
-                               std::string level;
-                               advance_ws(remainder, level);
-                               G13_Manager::Instance()->SetLogLevel(level);
-                             });
-
-  commandAdder add_refresh(
-      _command_table, "refresh",
-      [this](const char *remainder) { lcd().image_send(); });
-
-  commandAdder add_clear(_command_table, "clear",
-                         [this](const char *remainder) {
-                           lcd().image_clear();
-                           lcd().image_send();
-                         });
-
-  commandAdder add_delete(_command_table, "delete",
-                          [this](const char *remainder) {
+  }
+
+  static void log_level(G13_Device &, const char *remainder, std::ostream &) {
+    std::string level;
+    Helper::advance_ws(remainder, level);
+    try {
+      log4cpp::Priority::getPriorityValue(level);
+    } catch (std::invalid_argument &) {
+      throw G13_CommandException("unknown log level " + level);
+    }
+    G13_Manager::Instance()->SetLogLevel(level);
+  }
+
+  static void refresh(G13_Device &g13, const char *, std::ostream &) {
+    g13.lcd().image_refresh();
+  }
+
+  static void clear(G13_Device &g13, const char *, std::ostream &) {
+    g13.lcd().image_clear();
+    g13.lcd().image_send();
+  }
+
+  static void delete_(G13_Device &g13, const char *remainder,
+                      std::ostream &out) {
     std::string target;
     std::string glob;
     bool found = false;
-    advance_ws(remainder, target);
-    advance_ws(remainder, glob);
-    std::regex re(glob2regex(glob.c_str()));
+    Helper::advance_ws(remainder, target);
+    Helper::advance_ws(remainder, glob);
+    std::regex re(Helper::glob2regex(glob.c_str()));
 
     if (target == "profile") {
-      for (auto &profile: FilteredProfileNames(re)) {
-        m_profiles.erase(profile);
-        G13_OUT("profile " << profile << " deleted");
+      for (auto &profile: g13.FilteredProfileNames(re)) {
+        g13.m_profiles.erase(profile);
+        g13.m_profiles_generation++;
+        out << "profile " << profile << " deleted" << std::endl;
         found = true;
       }
     } else if (target == "key") {
-      for (auto key: m_currentProfile->FilteredKeyNames(re)) {
-        m_currentProfile->FindKey(key)->set_action(nullptr);
-        G13_OUT("key " << key << " unbound");
+      for (auto key: g13.m_currentProfile->FilteredKeyNames(re)) {
+        g13.m_currentProfile->FindKey(key)->set_action(nullptr);
+        out << "key " << key << " unbound" << std::endl;
         found = true;
       }
     } else if (target == "zone") {
-      for (auto &zone: m_stick.FilteredZoneNames(re)) {
-        m_stick.RemoveZone(*m_stick.zone(zone));
-        G13_OUT("stickzone " << zone << " unbound");
+      for (auto &zone: g13.m_stick.FilteredZoneNames(re)) {
+        g13.m_stick.RemoveZone(*g13.m_stick.zone(zone));
+        out << "stickzone " << zone << " unbound" << std::endl;
         found = true;
       }
     } else {
-      G13_ERR("unknown delete target: <" << target << ">");
-      found = true;
+      throw G13_CommandException("unknown delete target: <" + target + ">");
     }
     if (!found)
-      G13_OUT("no " << target << " name matches <" << glob << ">");
-  });
+      out << "no " << target << " name matches <" << glob << ">" << std::endl;
+  }
 
-  commandAdder add_load(_command_table, "load", [this](const char *remainder) {
+  static void load(G13_Device &g13, const char *remainder, std::ostream &) {
     std::string filename;
-    advance_ws(remainder, filename);
-    ReadCommandsFromFile(filename,
-                         std::string(1 + m_filesLoading.size(), '>').c_str());
-  });
+    Helper::advance_ws(remainder, filename);
+    g13.ReadCommandsFromFile(
+        filename, std::string(1 + g13.m_filesLoading.size(), '>').c_str());
+  }
+};
+
+// sorted by name for FindCommand
+static constexpr G13_Device::CommandEntry g13_commands[] = {
+    {"arc", nullptr, G13_Commands::arc},
+    {"bind", G13_Commands::bind, nullptr},
+    {"blit", nullptr, G13_Commands::blit},
+    {"circle", nullptr, G13_Commands::circle},
+    {"clear", G13_Commands::clear, nullptr},
+    {"delete", G13_Commands::delete_, nullptr},
+    {"dump", G13_Commands::dump, nullptr},
+    {"fillcircle", nullptr, G13_Commands::fillcircle},
+    {"fillrect", nullptr, G13_Commands::fillrect},
+    {"font", nullptr, G13_Commands::font},
+    {"image", G13_Commands::image, nullptr},
+    {"line", nullptr, G13_Commands::line},
+    {"load", G13_Commands::load, nullptr},
+    {"log_level", G13_Commands::log_level, nullptr},
+    {"mod", nullptr, G13_Commands::mod},
+    {"out", nullptr, G13_Commands::out},
+    {"pixel", nullptr, G13_Commands::pixel},
+    {"pos", G13_Commands::pos, nullptr},
+    {"profile", nullptr, G13_Commands::profile},
+    {"record", G13_Commands::record, nullptr},
+    {"rect", nullptr, G13_Commands::rect},
+    {"refresh", G13_Commands::refresh, nullptr},
+    {"rgb", nullptr, G13_Commands::rgb},
+    {"rgbfx", nullptr, G13_Commands::rgbfx},
+    {"stats", G13_Commands::stats, nullptr},
+    {"stickdeadzone", G13_Commands::stickdeadzone, nullptr},
+    {"stickmode", G13_Commands::stickmode, nullptr},
+    {"stickzone", G13_Commands::stickzone, nullptr},
+    {"textmode", nullptr, G13_Commands::textmode},
+    {"widget", G13_Commands::widget, nullptr},
+};
+
+static constexpr bool g13_commands_sorted() {
+  for (size_t i = 1; i < std::size(g13_commands); i++) {
+    if (!(g13_commands[i - 1].name < g13_commands[i].name))
+      return false;
+  }
+  return true;
+}
+static_assert(g13_commands_sorted(), "g13_commands must be sorted by name");
+
+const G13_Device::CommandEntry *G13_Device::FindCommand(std::string_view name) {
+  auto end = std::end(g13_commands);
+  auto entry = std::lower_bound(
+      std::begin(g13_commands), end, name,
+      [](const CommandEntry &e, std::string_view n) { return e.name < n; });
+  return entry != end && entry->name == name ? entry : nullptr;
 }
 
-void G13_Device::Command(char const *str, const char *info) {
+void G13_Device::RunCommand(const char *str, std::ostream &out) {
   const char *remainder = str;
+  std::string_view cmd;
+  Helper::advance_ws(remainder, cmd);
+  if (cmd.empty())
+    return;
 
-  try {
-    using Helper::advance_ws;
-    using Helper::ltrim;
+  auto command = FindCommand(cmd);
+  if (!command) {
+    throw G13_CommandException("unknown command : " + std::string(cmd));
+  }
+  if (command->run) {
+    command->run(*this, remainder, out);
+  } else {
+    command->compile(*this, remainder)();
+  }
+}
 
-    std::string cmd;
-    advance_ws(remainder, cmd);
+// logs what a command printed, line by line
+static void LogCommandOutput(const std::string &output) {
+  std::istringstream lines(output);
+  std::string line;
+  while (std::getline(lines, line)) {
+    G13_OUT(line);
+  }
+}
 
-    if (cmd != "") {
-      auto i = _command_table.find(cmd);
-      if (info)
-        G13_OUT(info << ": " << ltrim(str));
-      if (i == _command_table.end()) {
-        G13_ERR("unknown command : " << cmd);
-      } else {
-        COMMAND_FUNCTION f = i->second;
-        f(remainder);
-      }
-    }
+void G13_Device::Command(char const *str, const char *info) {
+  const char *remainder = str;
+  std::string_view cmd;
+  Helper::advance_ws(remainder, cmd);
+  if (cmd.empty())
+    return;
+  if (info)
+    G13_OUT(info << ": " << Helper::ltrim(str));
+
+  std::ostringstream out;
+  try {
+    RunCommand(str, out);
   } catch (const std::exception &ex) {
     G13_ERR("command failed : " << ex.what());
   }
+  LogCommandOutput(out.str());
 }
 
-void G13_Device::RegisterContext(libusb_context *libusbContext) {
-  m_ctx = libusbContext;
+G13_Device::BOUND_COMMAND G13_Device::CompileCommand(const char *str) {
+  const char *remainder = str;
+  std::string_view cmd;
+  Helper::advance_ws(remainder, cmd);
 
+  auto command = FindCommand(cmd);
+  if (!command) {
+    throw G13_CommandException("unknown command : " + std::string(cmd));
+  }
+  if (command->compile) {
+    return command->compile(*this, remainder);
+  }
+  // no ahead of time parsing, at least skip the lookup
+  return [this, run = command->run, args = std::string(remainder)]() {
+    std::ostringstream out;
+    run(*this, args.c_str(), out);
+    LogCommandOutput(out.str());
+  };
+}
+
+void G13_Device::WidgetTick() {
+  bool drawn = false;
+  for (auto &widget : m_widgets) {
+    drawn |= widget.second->Update();
+  }
+  if (drawn) {
+    lcd().image_send();
+  }
+}
+
+void G13_Device::Setup() {
   int leds = 0;
   int red = 0;
   int green = 0;
@@ -613,29 +1207,54 @@ void G13_Device::RegisterContext(libusb_context *libusbContext) {
   SetModeLeds(leds);
   SetKeyColor(red, green, blue);
 
+  m_bare_images = G13_Manager::getStringConfigValue("bare_images") != "off";
   m_uinput_fid = G13CreateUinput(this);
   m_input_pipe_name = G13_Manager::Instance()->MakePipeName(this, true);
   m_input_pipe_fid = G13CreateFifo(m_input_pipe_name.c_str(),
                                    S_IRGRP | S_IROTH);
   if (m_input_pipe_fid == -1) {
     G13_ERR("failed opening input pipe " << m_input_pipe_name);
+  } else {
+    G13_Manager::WatchFd(m_input_pipe_fid, EPOLLIN,
+                         [this](uint32_t) { ReadCommandsFromPipe(); });
   }
   m_output_pipe_name = G13_Manager::Instance()->MakePipeName(this, false);
   m_output_pipe_fid = G13CreateFifo(m_output_pipe_name.c_str(),
                                     S_IWGRP | S_IWOTH);
   if (m_output_pipe_fid == -1) {
     G13_ERR("failed opening output pipe " << m_output_pipe_name);
+  } else {
+    m_event_bus.Subscribe(m_output_pipe_fid, G13_EVENT_OUT, false, true,
+                          false);
   }
+  lcd().ShareStart(G13_Manager::MakeControlName(this, "lcd_socket", "_lcd"));
+
+  m_transport->StartKeyReader();
 }
 
 void G13_Device::Cleanup() {
+  m_transport->StopKeyReader();
+  m_recorder.reset();
+  m_event_bus.Clear();
+  G13_Manager::RemoveTimer(m_widget_timer);
+  m_widget_timer = -1;
+  m_rgbfx.Stop();
+  lcd().ShareStop();
   SetKeyColor(0, 0, 0);
+  // the transfers still queued report to m_stats, destroyed before
+  // m_transport
+  m_transport->Stop();
+  if (m_input_pipe_fid > 0) {
+    G13_Manager::UnwatchFd(m_input_pipe_fid);
+    close(m_input_pipe_fid);
+  }
+  if (m_output_pipe_fid > 0) {
+    close(m_output_pipe_fid);
+  }
   remove(m_input_pipe_name.c_str());
   remove(m_output_pipe_name.c_str());
   ioctl(m_uinput_fid, UI_DEV_DESTROY);
   close(m_uinput_fid);
-  libusb_release_interface(handle, 0);
-  libusb_close(handle);
 }
 
 G13_Device::~G13_Device() {
@@ -644,6 +1263,6 @@ G13_Device::~G13_Device() {
 
 // libusb_device_handle *G13_Device::Handle() const { return handle; }
 
-libusb_device *G13_Device::Device() const { return device; }
+libusb_device *G13_Device::Device() const { return m_transport->Device(); }
 
 } // namespace G13
@@ -4,10 +4,16 @@
 #ifndef G13_G13_DEVICE_HPP
 #define G13_G13_DEVICE_HPP
 
+#include "g13_events.hpp"
 #include "g13_lcd.hpp"
 #include "g13_manager.hpp"
 #include "g13_profile.hpp"
+#include "g13_rgbfx.hpp"
+#include "g13_stats.hpp"
 #include "g13_stick.hpp"
+#include "g13_transport.hpp"
+#include "g13_widget.hpp"
+#include <bitset>
 #include <functional>
 #include <libusb-1.0/libusb.h>
 #include <linux/uinput.h>
@@ -15,6 +21,7 @@
 #include <vector>
 #include <memory>
 #include <regex>
+#include <string_view>
 
 namespace G13 {
 // *************************************************************************
@@ -24,17 +31,43 @@ class G13_Action;
 class G13_Manager;
 
 class G13_Font;
+class G13_Recorder;
 
 typedef std::shared_ptr<G13_Profile> ProfilePtr;
 typedef std::shared_ptr<G13_Action> G13_ActionPtr;
 typedef std::shared_ptr<G13_Font> FontPtr;
 
 const size_t G13_NUM_KEYS = 40;
+const size_t G13_EVENT_BATCH_SIZE = 64;
+const int G13_KEY_FORCE_UP = -1;
+// longest command line accepted from the input pipe
+const size_t G13_PIPE_BUFFER_SIZE = 64 * 1024;
+
+/*
+ * Binary frames can be mixed with text commands on the input pipe. A frame
+ * starts where a line would, with a G13_FrameHeader followed by length
+ * bytes of payload.
+ */
+const char G13_FRAME_MAGIC[4] = {'\x1b', 'G', '1', '3'};
+
+enum G13_FrameType : uint8_t {
+  G13_FRAME_LCD = 1, // G13_LCD_BUF_SIZE bytes image in G13 layout
+};
+
+struct G13_FrameHeader {
+  char magic[4];
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t length; // little endian
+};
+
+static_assert(sizeof(G13_FrameHeader) == 8, "frame header layout");
 
 class G13_Device {
 public:
   G13_Device(libusb_device *dev, libusb_context *ctx,
              libusb_device_handle *handle, int m_id);
+  G13_Device(std::unique_ptr<G13_Transport> transport, int m_id);
   ~G13_Device();
 
   G13_LCD &lcd() { return m_lcd; }
@@ -43,6 +76,10 @@ public:
 
   G13_Stick &stick() { return m_stick; }
 
+  G13_Stats &stats() { return m_stats; }
+
+  G13_EventBus &events() { return m_event_bus; }
+
   // [[nodiscard]] const G13_Stick &stick() const { return m_stick; }
 
   FontPtr SwitchToFont(const std::string &name);
@@ -55,8 +92,12 @@ public:
 
   void Dump(std::ostream &o, int detail = 0);
 
+  // runs a command line, logging failures; output goes to stdout
   void Command(char const *str, const char *info = nullptr);
 
+  // runs a command line, throws G13_CommandException when it fails
+  void RunCommand(const char *str, std::ostream &out);
+
   void ReadCommandsFromPipe();
 
   void ReadCommandsFromFile(const std::string &filename,
@@ -64,45 +105,85 @@ public:
 
   void ReadConfigFile(const std::string &filename);
 
-  int ReadKeypresses();
+  void ReadKeypresses(const unsigned char *buffer);
 
-  void parse_joystick(unsigned char *buf);
+  void parse_joystick(const unsigned char *buf);
 
   G13_ActionPtr MakeAction(const std::string &action);
 
   void SetKeyColor(int red, int green, int blue);
 
+  // the backlight colour last set
+  [[nodiscard]] G13_Color key_color() const { return m_key_color; }
+
   void SetModeLeds(int leds);
 
+  // queues an input event, written out by FlushEvents()
   void SendEvent(int type, int code, int val);
 
-  void OutputPipeWrite(const std::string &out) const;
+  // terminates the queued events with a SYN_REPORT and writes them
+  void SyncEvents();
 
-  void LcdWrite(unsigned char *data, size_t size);
+  void FlushEvents();
 
-  // bool is_set(int key);
+  /*
+   * queues a precompiled key sequence, EV_KEY events with value 1 (press),
+   * 0 (release) or G13_KEY_FORCE_UP. Output keys are reference counted, so
+   * bindings sharing a key do not release it while another one still holds
+   * it down; a forced release lets go of it no matter who holds it.
+   */
+  void SendKeys(const input_event *events, size_t count);
+
+  // publishes out as a pipe output event, see G13_EventBus
+  void OutputPipeWrite(const std::string &out);
 
-  bool update(int key, bool v);
+  // queues an event, sent once the report being handled is done
+  void PublishEvent(G13_EventType type, const std::string &text);
+
+  void LcdWrite(unsigned char *data, size_t size);
+
+  // stores the new key state bitmask, returns the bits that changed
+  uint64_t UpdateKeyState(uint64_t state);
 
   // used by G13_Manager
   void Cleanup();
 
 
-  void RegisterContext(libusb_context *libusbContext);
+  void Setup();
 
   void LcdWriteFile(const std::string &filename);
 
   G13_Font &current_font() { return *m_currentFont; }
 
+  FontPtr current_font_ptr() { return m_currentFont; }
+
   // G13_Profile &current_profile() { return *m_currentProfile; }
 
   [[nodiscard]] int id_within_manager() const { return m_id_within_manager; }
 
   static std::string DescribeLibusbErrorCode(int code);
 
-  // typedef boost::function<void(const char*)> COMMAND_FUNCTION;
-  typedef std::function<void(const char *)> COMMAND_FUNCTION;
-  typedef std::map<std::string, COMMAND_FUNCTION> CommandFunctionTable;
+  // a command with its arguments already parsed, as bound to keys with '!'
+  typedef std::function<void()> BOUND_COMMAND;
+
+  typedef void (*COMMAND_FUNCTION)(G13_Device &, const char *, std::ostream &);
+  typedef BOUND_COMMAND (*COMMAND_COMPILER)(G13_Device &, const char *);
+
+  /*! entry of the command table shared by all devices
+   *
+   * A command either runs straight from its argument string or, when it
+   * can parse its arguments ahead of time, has a compiler instead.
+   */
+  struct CommandEntry {
+    std::string_view name;
+    COMMAND_FUNCTION run;
+    COMMAND_COMPILER compile;
+  };
+
+  static const CommandEntry *FindCommand(std::string_view name);
+
+  // parses a command once for repeated use, throws G13_CommandException
+  BOUND_COMMAND CompileCommand(const char *str);
 
   /*
           void setManager(G13_Manager manager) {
@@ -115,53 +196,86 @@ public:
 protected:
   void InitFonts();
 
+  void StartFrame(const G13_FrameHeader &header);
+
+  // n more payload bytes have been stored at m_frame_dest or skipped
+  void FrameData(size_t n);
+
   void LcdInit();
 
-  void InitCommands();
+  // updates the widgets and sends the LCD buffer if one of them changed
+  void WidgetTick();
+
+  // makes profile current and tells the event subscribers
+  void SetCurrentProfile(ProfilePtr profile);
 
-  // typedef void (COMMAND_FUNCTION)( G13_Device*, const char *, const char * );
-  CommandFunctionTable _command_table;
+  // the command handlers
+  friend struct G13_Commands;
 
-  // struct timeval _event_time;
-  struct input_event m_event {};
+  // events gathered while handling one report
+  struct input_event m_events[G13_EVENT_BATCH_SIZE]{};
+  size_t m_event_count{};
 
   int m_id_within_manager;
-  libusb_context *m_ctx;
+  std::unique_ptr<G13_Transport> m_transport;
 
   int m_uinput_fid;
 
   int m_input_pipe_fid{};
   std::string m_input_pipe_name;
-  std::string m_input_pipe_fifo;
+  // input pipe data not yet run, a partial line at the front
+  std::vector<char> m_pipe_buffer = std::vector<char>(G13_PIPE_BUFFER_SIZE);
+  size_t m_pipe_fill{};
+  // skipping the rest of an overlong line
+  bool m_pipe_discard{};
+  // a single read of G13_LCD_BUFFER_SIZE bytes is an unframed image
+  bool m_bare_images = true;
+
+  // frame being received, payload goes to m_frame_dest or is skipped
+  uint8_t m_frame_type{};
+  size_t m_frame_remaining{};
+  unsigned char *m_frame_dest{};
+  // LCD frame payload, only copied to the LCD once complete so that the
+  // flush timer never sends half of it
+  unsigned char m_frame_image[G13_LCD_BUF_SIZE]{};
   int m_output_pipe_fid{};
   std::string m_output_pipe_name;
+  // subscribers of key, profile and pipe output events, the output pipe
+  // being one of them
+  G13_EventBus m_event_bus;
 
   std::map<std::string, FontPtr> pFonts;
   FontPtr m_currentFont;
   std::map<std::string, ProfilePtr> m_profiles;
+  // changed whenever profiles are deleted, invalidates bound profile switches
+  unsigned m_profiles_generation{};
   ProfilePtr m_currentProfile;
   std::vector<std::string> m_filesLoading;
 
   G13_LCD m_lcd;
+  // drawn by a timer running while there are widgets
+  std::map<std::string, std::unique_ptr<G13_Widget>> m_widgets;
+  int m_widget_timer = -1;
+  G13_Color m_key_color{};
+  G13_RgbEffects m_rgbfx{*this};
   G13_Stick m_stick;
+  G13_Stats m_stats;
+  std::unique_ptr<G13_Recorder> m_recorder; // set while recording
+  // completion time of the report being handled, 0 outside of reports
+  uint64_t m_report_start{};
 
-  bool keys[G13_NUM_KEYS]{};
+  // bit n set while key n of G13_KEY_STRINGS is down
+  uint64_t m_key_state{};
 
-private:
-  libusb_device_handle *handle;
-  libusb_device *device;
+  // output keys held down by actions, and how many actions hold each
+  std::bitset<G13_OUTPUT_KEYS> m_keys_held;
+  uint8_t m_key_holds[G13_OUTPUT_KEYS]{};
 };
 
-/*
-inline bool G13_Device::is_set(int key) {
-    return keys[key];
-}
-*/
-
-inline bool G13_Device::update(int key, bool v) {
-  bool old = keys[key];
-  keys[key] = v;
-  return old != v;
+inline uint64_t G13_Device::UpdateKeyState(uint64_t state) {
+  uint64_t changed = m_key_state ^ state;
+  m_key_state = state;
+  return changed;
 }
 } // namespace G13
 
@@ -0,0 +1,192 @@
+//
+// Single threaded event loop driving libusb, the control pipes, signals and
+// timers from one epoll set.
+//
+
+#include "g13_manager.hpp"
+#include "g13_device.hpp"
+#include <csignal>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace G13 {
+
+int G13_Manager::epollFd = -1;
+int G13_Manager::signalFd = -1;
+std::map<int, G13_Manager::FdHandler> G13_Manager::fdHandlers;
+
+bool G13_Manager::WatchFd(int fd, uint32_t events, FdHandler handler) {
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+
+  int op = fdHandlers.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(epollFd, op, fd, &ev) < 0) {
+    G13_ERR("Cannot watch fd " << fd << ": " << strerror(errno));
+    return false;
+  }
+  fdHandlers[fd] = std::move(handler);
+  return true;
+}
+
+void G13_Manager::UnwatchFd(int fd) {
+  if (fdHandlers.erase(fd)) {
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+  }
+}
+
+int G13_Manager::AddTimer(unsigned int interval_ms,
+                          std::function<void()> callback) {
+  int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer < 0) {
+    G13_ERR("Cannot create timer: " << strerror(errno));
+    return -1;
+  }
+
+  itimerspec spec{};
+  spec.it_interval.tv_sec = interval_ms / 1000;
+  spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+  spec.it_value = spec.it_interval;
+  timerfd_settime(timer, 0, &spec, nullptr);
+
+  auto expired = [timer, callback = std::move(callback)](uint32_t) {
+    uint64_t expirations;
+    if (read(timer, &expirations, sizeof(expirations)) > 0) {
+      callback();
+    }
+  };
+  if (!WatchFd(timer, EPOLLIN, expired)) {
+    close(timer);
+    return -1;
+  }
+  return timer;
+}
+
+void G13_Manager::RemoveTimer(int timer) {
+  if (timer < 0)
+    return;
+  UnwatchFd(timer);
+  close(timer);
+}
+
+void LIBUSB_CALL G13_Manager::PollfdAdded(int fd, short events,
+                                          void *user_data) {
+  uint32_t epoll_events = 0;
+  if (events & POLLIN)
+    epoll_events |= EPOLLIN;
+  if (events & POLLOUT)
+    epoll_events |= EPOLLOUT;
+  G13_DBG("libusb pollfd " << fd << " added");
+  WatchFd(fd, epoll_events, [](uint32_t) { HandleUsbEvents(); });
+}
+
+void LIBUSB_CALL G13_Manager::PollfdRemoved(int fd, void *user_data) {
+  G13_DBG("libusb pollfd " << fd << " removed");
+  UnwatchFd(fd);
+}
+
+void G13_Manager::HandleUsbEvents() {
+  struct timeval tv {};
+  int error = libusb_handle_events_timeout_completed(libusbContext, &tv,
+                                                     nullptr);
+  if (error != LIBUSB_SUCCESS && error != LIBUSB_ERROR_INTERRUPTED) {
+    G13_ERR("Error: " << G13_Device::DescribeLibusbErrorCode(error));
+  }
+}
+
+bool G13_Manager::InitEventLoop() {
+  epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd < 0) {
+    G13_ERR("Cannot create epoll instance: " << strerror(errno));
+    return false;
+  }
+
+  // Signals are delivered through the loop instead of interrupting it
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  sigprocmask(SIG_BLOCK, &mask, nullptr);
+  signalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (signalFd < 0) {
+    G13_ERR("Cannot create signal fd: " << strerror(errno));
+    return false;
+  }
+  WatchFd(signalFd, EPOLLIN, [](uint32_t) {
+    signalfd_siginfo info{};
+    while (read(signalFd, &info, sizeof(info)) == sizeof(info)) {
+      SignalHandler((int)info.ssi_signo);
+    }
+  });
+
+  // Hand every libusb file descriptor over to epoll and keep track of
+  // the ones libusb opens and closes later on
+  const libusb_pollfd **pollfds = libusb_get_pollfds(libusbContext);
+  if (!pollfds) {
+    G13_ERR("libusb does not expose its file descriptors");
+    return false;
+  }
+  for (auto pollfd = pollfds; *pollfd; pollfd++) {
+    PollfdAdded((*pollfd)->fd, (*pollfd)->events, nullptr);
+  }
+  libusb_free_pollfds(pollfds);
+  libusb_set_pollfd_notifiers(libusbContext, PollfdAdded, PollfdRemoved,
+                              nullptr);
+  return true;
+}
+
+void G13_Manager::CleanupEventLoop() {
+  if (libusbContext) {
+    libusb_set_pollfd_notifiers(libusbContext, nullptr, nullptr, nullptr);
+  }
+  fdHandlers.clear();
+  if (signalFd >= 0) {
+    close(signalFd);
+    signalFd = -1;
+  }
+  if (epollFd >= 0) {
+    close(epollFd);
+    epollFd = -1;
+  }
+}
+
+void G13_Manager::DispatchEvents() {
+  const int max_events = 16;
+  epoll_event events[max_events];
+  int timeout = -1;
+
+  // Older kernels lack timerfd support in libusb, then we handle its
+  // timeouts ourselves
+  struct timeval tv {};
+  if (!libusb_pollfds_handle_timeouts(libusbContext) &&
+      libusb_get_next_timeout(libusbContext, &tv) == 1) {
+    timeout = (int)(tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+  }
+
+  int count = epoll_wait(epollFd, events, max_events, timeout);
+  if (count < 0) {
+    if (errno != EINTR) {
+      G13_ERR("epoll_wait failed: " << strerror(errno));
+      running = false;
+    }
+    return;
+  }
+  if (count == 0) {
+    HandleUsbEvents();
+    return;
+  }
+
+  for (int i = 0; i < count; i++) {
+    // A handler may unwatch other descriptors, so look each one up again
+    auto i_handler = fdHandlers.find(events[i].data.fd);
+    if (i_handler != fdHandlers.end()) {
+      FdHandler handler = i_handler->second;
+      handler(events[i].events);
+    }
+  }
+}
+
+} // namespace G13
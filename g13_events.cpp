@@ -0,0 +1,231 @@
+//
+// Event stream: key, profile and pipe output events of a device, fanned out
+// to any number of subscribers without ever waiting for one of them
+//
+
+#include "g13_events.hpp"
+#include "g13_manager.hpp"
+#include <algorithm>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace G13 {
+
+static const char *EventPrefix(G13_EventType type) {
+  switch (type) {
+  case G13_EVENT_KEY:
+    return "key ";
+  case G13_EVENT_PROFILE:
+    return "profile ";
+  case G13_EVENT_OUT:
+    return "out ";
+  default:
+    return "";
+  }
+}
+
+G13_EventSubscriber::G13_EventSubscriber(int fd, unsigned mask, bool packets,
+                                         bool raw, bool owned)
+    : m_fd(fd), m_mask(mask), m_packets(packets), m_raw(raw), m_owned(owned),
+      m_ring(G13_EVENT_QUEUE) {}
+
+G13_EventSubscriber::~G13_EventSubscriber() {
+  if (m_owned)
+    close(m_fd);
+}
+
+// returns the slot for a new event, making room by dropping the oldest
+std::string &G13_EventSubscriber::Slot() {
+  if (m_count == m_ring.size()) {
+    // a partly written event has to be finished, drop the next one instead
+    if (m_offset) {
+      std::swap(m_ring[m_head], m_ring[(m_head + 1) % m_ring.size()]);
+    }
+    m_head = (m_head + 1) % m_ring.size();
+    m_count--;
+    m_dropped++;
+  }
+  return m_ring[(m_head + m_count++) % m_ring.size()];
+}
+
+void G13_EventSubscriber::Push(G13_EventType type, const std::string &text) {
+  auto &slot = Slot();
+  if (m_raw) {
+    slot.assign(text);
+  } else {
+    slot.assign(EventPrefix(type));
+    slot.append(text);
+  }
+}
+
+void G13_EventSubscriber::PushRaw(const std::string &text) {
+  Slot().assign(text);
+}
+
+bool G13_EventSubscriber::Drain() {
+  while (m_count) {
+    auto &event = m_ring[m_head];
+    ssize_t written;
+    if (m_packets) {
+      written = send(m_fd, event.data(), event.size(),
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else {
+      written = write(m_fd, event.data() + m_offset, event.size() - m_offset);
+    }
+    if (written < 0) {
+      if (errno == EAGAIN || errno == EINTR)
+        return true;
+      if (errno != EMSGSIZE)
+        return false;
+      // larger than the socket can take, skip it
+      m_dropped++;
+    } else if (!m_packets && m_offset + written < event.size()) {
+      m_offset += written;
+      continue;
+    } else {
+      m_sent++;
+    }
+    m_offset = 0;
+    m_head = (m_head + 1) % m_ring.size();
+    m_count--;
+  }
+  return true;
+}
+
+void G13_EventSubscriber::dump(std::ostream &o) const {
+  o << "   subscriber fd=" << m_fd << " mask=" << m_mask
+    << " queued=" << m_count << " sent=" << m_sent
+    << " dropped=" << m_dropped << std::endl;
+}
+
+// *************************************************************************
+
+void G13_EventBus::Publish(G13_EventType type, const std::string &text) {
+  if (!wants(type))
+    return;
+  for (auto &subscriber : m_subscribers) {
+    if (subscriber->mask() & type) {
+      subscriber->Push(type, text);
+    }
+  }
+  m_pending = true;
+}
+
+G13_EventSubscriber &G13_EventBus::Subscribe(int fd, unsigned mask,
+                                             bool packets, bool raw,
+                                             bool owned) {
+  m_subscribers.push_back(
+      std::make_unique<G13_EventSubscriber>(fd, mask, packets, raw, owned));
+  auto &subscriber = *m_subscribers.back();
+  UpdateMask();
+  // whatever the caller queues next goes out with the next Flush()
+  m_pending = true;
+  Watch(subscriber);
+  G13_DBG("event subscriber " << fd << " added, mask " << mask);
+  return subscriber;
+}
+
+void G13_EventBus::Unsubscribe(int fd) {
+  auto i_subscriber = std::find_if(
+      m_subscribers.begin(), m_subscribers.end(),
+      [fd](const std::unique_ptr<G13_EventSubscriber> &subscriber) {
+        return subscriber->fd() == fd;
+      });
+  if (i_subscriber == m_subscribers.end())
+    return;
+  G13_Manager::UnwatchFd(fd);
+  m_subscribers.erase(i_subscriber);
+  UpdateMask();
+  G13_DBG("event subscriber " << fd << " removed");
+}
+
+void G13_EventBus::Clear() {
+  while (!m_subscribers.empty()) {
+    Unsubscribe(m_subscribers.back()->fd());
+  }
+}
+
+void G13_EventBus::Flush() {
+  if (!m_pending)
+    return;
+  m_pending = false;
+
+  std::vector<int> gone;
+  for (auto &subscriber : m_subscribers) {
+    if (subscriber->waiting || subscriber->empty())
+      continue;
+    if (!subscriber->Drain()) {
+      gone.push_back(subscriber->fd());
+    } else if (!subscriber->empty()) {
+      subscriber->waiting = true;
+      Watch(*subscriber);
+    }
+  }
+  for (auto fd : gone) {
+    Unsubscribe(fd);
+  }
+}
+
+void G13_EventBus::Watch(G13_EventSubscriber &subscriber) {
+  int fd = subscriber.fd();
+  uint32_t events = subscriber.waiting ? EPOLLOUT : 0;
+  // owned fds are sockets, watch them for their peer going away
+  if (subscriber.owned())
+    events |= EPOLLIN;
+  if (events) {
+    G13_Manager::WatchFd(fd, events,
+                         [this, fd](uint32_t events) { Events(fd, events); });
+  } else {
+    G13_Manager::UnwatchFd(fd);
+  }
+}
+
+void G13_EventBus::Events(int fd, uint32_t events) {
+  auto i_subscriber = std::find_if(
+      m_subscribers.begin(), m_subscribers.end(),
+      [fd](const std::unique_ptr<G13_EventSubscriber> &subscriber) {
+        return subscriber->fd() == fd;
+      });
+  if (i_subscriber == m_subscribers.end())
+    return;
+  auto &subscriber = **i_subscriber;
+
+  if (events & EPOLLIN) {
+    // subscribers have nothing to say, only notice them hanging up
+    char discard[256];
+    if (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) == 0) {
+      Unsubscribe(fd);
+      return;
+    }
+  }
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    Unsubscribe(fd);
+    return;
+  }
+  if (events & EPOLLOUT) {
+    if (!subscriber.Drain()) {
+      Unsubscribe(fd);
+      return;
+    }
+    if (subscriber.empty()) {
+      subscriber.waiting = false;
+      Watch(subscriber);
+    }
+  }
+}
+
+void G13_EventBus::UpdateMask() {
+  m_mask = 0;
+  for (auto &subscriber : m_subscribers) {
+    m_mask |= subscriber->mask();
+  }
+}
+
+void G13_EventBus::dump(std::ostream &o) const {
+  for (auto &subscriber : m_subscribers) {
+    subscriber->dump(o);
+  }
+}
+
+} // namespace G13
@@ -0,0 +1,125 @@
+//
+// Event stream: key, profile and pipe output events of a device, fanned out
+// to any number of subscribers without ever waiting for one of them
+//
+
+#ifndef G13_G13_EVENTS_HPP
+#define G13_G13_EVENTS_HPP
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace G13 {
+
+enum G13_EventType : unsigned {
+  G13_EVENT_KEY = 1,     // "key <name> down|up"
+  G13_EVENT_PROFILE = 2, // "profile <name>"
+  G13_EVENT_OUT = 4,     // "out <text>", text written by a '>' action
+  G13_EVENT_ALL = 7,
+};
+
+// events queued for a subscriber not keeping up, the oldest are dropped
+const size_t G13_EVENT_QUEUE = 256;
+
+/*!
+ * bounded ring of events waiting to be written to one subscriber
+ *
+ * Packet subscribers (SOCK_SEQPACKET) get each event as a message of its
+ * own, stream subscribers (FIFOs) get them back to back. Raw subscribers
+ * get the event text without its type, as the output pipe always did.
+ */
+class G13_EventSubscriber {
+public:
+  G13_EventSubscriber(int fd, unsigned mask, bool packets, bool raw,
+                      bool owned);
+  ~G13_EventSubscriber();
+
+  void Push(G13_EventType type, const std::string &text);
+  // queues text as is, regardless of the mask
+  void PushRaw(const std::string &text);
+
+  // writes what the fd takes, false once the subscriber is gone
+  bool Drain();
+
+  [[nodiscard]] int fd() const { return m_fd; }
+  [[nodiscard]] unsigned mask() const { return m_mask; }
+  [[nodiscard]] bool owned() const { return m_owned; }
+  [[nodiscard]] bool empty() const { return m_count == 0; }
+
+  void dump(std::ostream &o) const;
+
+  // waiting for EPOLLOUT
+  bool waiting = false;
+
+protected:
+  std::string &Slot();
+
+  int m_fd;
+  unsigned m_mask;
+  bool m_packets;
+  bool m_raw;
+  bool m_owned;
+
+  // slots keep their capacity, so queueing rarely allocates
+  std::vector<std::string> m_ring;
+  size_t m_head{};
+  size_t m_count{};
+  // bytes of the oldest event already written to a stream
+  size_t m_offset{};
+
+  uint64_t m_sent{};
+  uint64_t m_dropped{};
+};
+
+/*!
+ * the subscribers of a device
+ *
+ * Publish() only queues, Flush() writes with non-blocking calls and leaves
+ * the rest to the event loop, so a slow or stalled subscriber costs the
+ * input path nothing but its place in the ring.
+ */
+class G13_EventBus {
+public:
+  G13_EventBus() = default;
+  G13_EventBus(const G13_EventBus &) = delete;
+  ~G13_EventBus() { Clear(); }
+
+  [[nodiscard]] bool wants(G13_EventType type) const { return m_mask & type; }
+
+  void Publish(G13_EventType type, const std::string &text);
+
+  /*!
+   * adds a subscriber for the event types in mask. Owned fds are closed
+   * when the subscriber goes, and are watched to notice the peer leaving.
+   */
+  G13_EventSubscriber &Subscribe(int fd, unsigned mask, bool packets,
+                                 bool raw, bool owned);
+
+  void Unsubscribe(int fd);
+
+  // drops all subscribers
+  void Clear();
+
+  void Flush();
+
+  void dump(std::ostream &o) const;
+
+protected:
+  void Watch(G13_EventSubscriber &subscriber);
+
+  // subscriber fds are watched for EPOLLIN when owned, EPOLLOUT when waiting
+  void Events(int fd, uint32_t events);
+
+  void UpdateMask();
+
+  std::vector<std::unique_ptr<G13_EventSubscriber>> m_subscribers;
+  unsigned m_mask{};
+  bool m_pending{};
+};
+
+} // namespace G13
+
+#endif // G13_G13_EVENTS_HPP
@@ -6,6 +6,7 @@
 #include "g13.hpp"
 #include "g13_device.hpp"
 #include "g13_manager.hpp"
+#include <algorithm>
 #include <libevdev-1.0/libevdev/libevdev.h>
 #include <log4cpp/OstreamAppender.hh>
 #include <memory>
@@ -24,9 +25,6 @@ void G13::G13_Manager::DiscoverG13s(libusb_device **devs, ssize_t count) {
     }
     if (desc.idVendor == G13_VENDOR_ID && desc.idProduct == G13_PRODUCT_ID) {
       OpenAndAddG13(devs[i]);
-      for (auto g13 : g13s) {
-        SetupDevice(g13);
-      }
     }
   }
 }
@@ -62,6 +60,7 @@ int G13::G13_Manager::OpenAndAddG13(libusb_device *dev) {
     G13_DBG("Interface successfully claimed");
     auto g13 = new G13_Device(dev, libusbContext, handle, g13s.size());
     g13s.push_back(g13);
+    pendingSetup.push_back(g13);
     return 0;
   }
 
@@ -110,10 +109,14 @@ int LIBUSB_CALL G13::G13_Manager::HotplugCallbackRemove(
   for (auto iter = g13s.begin(); (iter != g13s.end()); ++i) {
     if (dev == (*iter)->Device()) {
       G13_OUT("Closing device " << i);
-      auto g13 = iter;
-      // (*g13)->Cleanup();
-      iter = g13s.erase(iter);  // remove from vector first
-      delete (*g13);            // delete the object after
+      auto g13 = *iter;
+      iter = g13s.erase(iter); // remove from vector first
+      pendingSetup.erase(
+          std::remove(pendingSetup.begin(), pendingSetup.end(), g13),
+          pendingSetup.end());
+      // NOTE: can not delete the device from this thread, its transfers
+      // still have to be reaped by the event loop
+      pendingRemoval.push_back(g13);
     } else {
       iter++;
     }
@@ -121,10 +124,24 @@ int LIBUSB_CALL G13::G13_Manager::HotplugCallbackRemove(
   return 0; // Rearm
 }
 
+void G13::G13_Manager::ProcessPendingDevices() {
+  // Deleting a device pumps libusb events, which may queue up more changes
+  while (!pendingRemoval.empty()) {
+    auto g13 = pendingRemoval.back();
+    pendingRemoval.pop_back();
+    delete g13;
+  }
+  while (!pendingSetup.empty()) {
+    auto g13 = pendingSetup.front();
+    pendingSetup.erase(pendingSetup.begin());
+    SetupDevice(g13);
+  }
+}
+
 void G13::G13_Manager::SetupDevice(G13_Device *g13) {
 
   G13_OUT("Setting up device ");
-  g13->RegisterContext(libusbContext);
+  g13->Setup();
   if (!logoFilename.empty()) {
     g13->LcdWriteFile(logoFilename);
   }
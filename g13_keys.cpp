@@ -52,15 +52,4 @@ void G13_Key::dump(std::ostream &o) const {
 
 // *************************************************************************
 
-void G13_Key::ParseKey(const unsigned char *byte, G13_Device *g13) {
-  bool key_is_down = byte[_index.offset] & _index.mask;
-  auto key_state_changed = g13->update(_index.index, key_is_down);
-
-  if (key_state_changed && _action) {
-    _action->act(*g13, key_is_down);
-  }
-}
-
-// *************************************************************************
-
 } // namespace G13
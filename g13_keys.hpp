@@ -5,6 +5,7 @@
 #ifndef G13_G13_KEYS_HPP
 #define G13_G13_KEYS_HPP
 
+#include <linux/input-event-codes.h>
 #include <string>
 #include <vector>
 
@@ -13,6 +14,8 @@ namespace G13 {
 typedef int G13_KEY_INDEX;
 typedef int LINUX_KEY_VALUE;
 const LINUX_KEY_VALUE BAD_KEY_VALUE = -1;
+// key and button codes actions can send
+const size_t G13_OUTPUT_KEYS = KEY_CNT;
 
 
 /*!
@@ -22,19 +22,31 @@
 #include "g13_device.hpp"
 #include "g13_fonts.hpp"
 #include "logo.hpp"
+#include <cmath>
 #include <fstream>
 #include <iostream>
+#include <iterator>
+#include <fcntl.h>
 #include <log4cpp/Category.hh>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 namespace G13 {
 
 void G13_Device::LcdInit() {
-  int error = libusb_control_transfer(handle, 0, 9, 1, 0, nullptr, 0, 1000);
+  int error = m_transport->InitLcd();
   if (error != LIBUSB_SUCCESS) {
     G13_ERR("Error when initializing LCD endpoint: "
             << G13_Device::DescribeLibusbErrorCode(error));
   } else {
     LcdWrite(g13_logo, sizeof(g13_logo));
+    lcd().ForgetSent();
   }
 }
 
@@ -44,18 +56,11 @@ void G13_Device::LcdWrite(unsigned char *data, size_t size) {
                                      << ", should be " << G13_LCD_BUFFER_SIZE);
     return;
   }
-  unsigned char buffer[G13_LCD_BUFFER_SIZE + 32];
-  memset(buffer, 0, G13_LCD_BUFFER_SIZE + 32);
-  buffer[0] = 0x03;
-  memcpy(buffer + 32, data, G13_LCD_BUFFER_SIZE);
-  int bytes_written;
-  int error = libusb_interrupt_transfer(
-      handle, LIBUSB_ENDPOINT_OUT | G13_LCD_ENDPOINT, buffer,
-      G13_LCD_BUFFER_SIZE + 32, &bytes_written, 1000);
+  int error = m_transport->WriteLcd(data);
   if (error) {
     G13_LOG(log4cpp::Priority::ERROR << "Error when transferring image: "
-                                     << DescribeLibusbErrorCode(error) << ", "
-                                     << bytes_written << " bytes written");
+                                     << DescribeLibusbErrorCode(error));
+    lcd().ForgetSent();
   }
 }
 
@@ -76,16 +81,96 @@ void G13_Device::LcdWriteFile(const std::string &filename) {
 
   filestr.close();
   LcdWrite((unsigned char *) buffer, size);
+  lcd().ForgetSent();
 }
 
 void G13_LCD::Image(unsigned char *data, int size) {
-  m_keypad.LcdWrite(data, size);
+  if (size != (int)G13_LCD_BUF_SIZE) {
+    // reports the bad size
+    m_keypad.LcdWrite(data, size);
+    return;
+  }
+  if (data != image_buf) {
+    memcpy(image_buf, data, G13_LCD_BUF_SIZE);
+  }
+  image_send();
 }
 
 G13_LCD::G13_LCD(G13_Device &keypad) : m_keypad(keypad) {
   cursor_col = 0;
   cursor_row = 0;
   text_mode = 0;
+
+  auto fps = G13_Manager::getStringConfigValue("lcd_fps");
+  int frames = fps.empty() ? G13_LCD_DEFAULT_FPS : atoi(fps.c_str());
+  // 0 sends every change right away
+  m_frame_interval = frames > 0 ? 1000000000ull / frames : 0;
+}
+
+G13_LCD::~G13_LCD() {
+  if (m_flush_timer >= 0) {
+    G13_Manager::UnwatchFd(m_flush_timer);
+    close(m_flush_timer);
+  }
+}
+
+void G13_LCD::image_send() {
+  m_dirty = true;
+  if (m_flush_armed)
+    return;
+  uint64_t since = G13_Stats::Now() - m_last_send;
+  if (since >= m_frame_interval) {
+    Flush();
+  } else {
+    ArmFlush(m_frame_interval - since);
+  }
+}
+
+void G13_LCD::image_refresh() {
+  m_sent_valid = false;
+  image_send();
+}
+
+void G13_LCD::Flush() {
+  if (!m_dirty)
+    return;
+  m_dirty = false;
+  auto &stats = m_keypad.stats();
+  if (m_sent_valid && !memcmp(m_sent, image_buf, G13_LCD_BUF_SIZE)) {
+    G13_Stats::count(stats.lcd_unchanged);
+    return;
+  }
+  memcpy(m_sent, image_buf, G13_LCD_BUF_SIZE);
+  m_sent_valid = true;
+  m_last_send = G13_Stats::Now();
+  G13_Stats::count(stats.lcd_frames);
+  m_keypad.LcdWrite(image_buf, G13_LCD_BUF_SIZE);
+}
+
+void G13_LCD::ArmFlush(uint64_t delay) {
+  if (m_flush_timer < 0) {
+    m_flush_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_flush_timer < 0 ||
+        !G13_Manager::WatchFd(m_flush_timer, EPOLLIN, [this](uint32_t) {
+          uint64_t expirations;
+          if (read(m_flush_timer, &expirations, sizeof(expirations)) > 0) {
+            m_flush_armed = false;
+            Flush();
+          }
+        })) {
+      G13_ERR("Cannot create LCD timer: " << strerror(errno));
+      if (m_flush_timer >= 0)
+        close(m_flush_timer);
+      m_flush_timer = -1;
+      Flush();
+      return;
+    }
+  }
+  itimerspec spec{};
+  spec.it_value.tv_sec = delay / 1000000000;
+  spec.it_value.tv_nsec = delay % 1000000000;
+  timerfd_settime(m_flush_timer, 0, &spec, nullptr);
+  m_flush_armed = true;
 }
 
 /*
@@ -213,4 +298,372 @@ void G13_LCD::image_test(int x, int y) {
 }
 */
 
+// *************************************************************************
+
+/*
+ * Drawing works on whole columns: the G13_LCD_ROWS pixels of column x are
+ * gathered into one 64 bit word, bit n being row n, so spans of rows are
+ * set, cleared or inverted with a single mask.
+ */
+
+static uint64_t RowMask(int y0, int y1) {
+  y0 = std::max(y0, 0);
+  y1 = std::min(y1, (int)G13_LCD_ROWS - 1);
+  if (y0 > y1)
+    return 0;
+  return (~0ull >> (63 - y1)) & (~0ull << y0);
+}
+
+uint64_t G13_LCD::Column(unsigned x) const {
+  uint64_t bits = 0;
+  for (unsigned page = 0; page < G13_LCD_ROWS / 8; page++) {
+    bits |= (uint64_t)image_buf[x + page * G13_LCD_COLUMNS] << (page * 8);
+  }
+  return bits;
+}
+
+void G13_LCD::SetColumn(unsigned x, uint64_t bits, uint64_t mask) {
+  for (unsigned page = 0; page < G13_LCD_ROWS / 8; page++) {
+    auto page_mask = (unsigned char)(mask >> (page * 8));
+    if (page_mask) {
+      auto &byte = image_buf[x + page * G13_LCD_COLUMNS];
+      byte = (byte & ~page_mask) | ((bits >> (page * 8)) & page_mask);
+    }
+  }
+}
+
+void G13_LCD::ColumnOp(int x, uint64_t mask, int color) {
+  if (x < 0 || x >= (int)G13_LCD_COLUMNS || !mask)
+    return;
+  uint64_t bits = 0;
+  if (color == G13_LCD_SET) {
+    bits = mask;
+  } else if (color == G13_LCD_INVERT) {
+    bits = ~Column(x);
+  }
+  SetColumn(x, bits, mask);
+}
+
+void G13_LCD::Pixel(int x, int y, int color) {
+  if (y >= 0 && y < (int)G13_LCD_ROWS)
+    ColumnOp(x, 1ull << y, color);
+}
+
+// num / den rounded to the nearest integer, halves up; den > 0
+static int64_t RoundedRatio(int64_t num, int64_t den) {
+  int64_t twice = 2 * num + den;
+  return twice >= 0 ? twice / (2 * den) : -((2 * den - 1 - twice) / (2 * den));
+}
+
+void G13_LCD::Line(int x0, int y0, int x1, int y1, int color) {
+  // vertical lines are a single column operation
+  if (x0 == x1) {
+    ColumnOp(x0, RowMask(std::min(y0, y1), std::max(y0, y1)), color);
+    return;
+  }
+  // one pixel per step along the longer axis, only over the steps that
+  // are on the screen, so the cost does not grow with the length
+  bool steep = abs((int64_t)y1 - y0) > abs((int64_t)x1 - x0);
+  if (steep) {
+    std::swap(x0, y0);
+    std::swap(x1, y1);
+  }
+  if (x0 > x1) {
+    std::swap(x0, x1);
+    std::swap(y0, y1);
+  }
+  int64_t limit = steep ? G13_LCD_ROWS : G13_LCD_COLUMNS;
+  int64_t from = std::max<int64_t>(x0, 0), to = std::min<int64_t>(x1, limit - 1);
+  for (int64_t x = from; x <= to; x++) {
+    int64_t y = y0 + RoundedRatio((x - x0) * ((int64_t)y1 - y0),
+                                  (int64_t)x1 - x0);
+    if (steep) {
+      if (y >= 0 && y < (int64_t)G13_LCD_COLUMNS)
+        Pixel((int)y, (int)x, color);
+    } else if (y >= 0 && y < (int64_t)G13_LCD_ROWS) {
+      Pixel((int)x, (int)y, color);
+    }
+  }
+}
+
+void G13_LCD::Rect(int x, int y, int w, int h, int color, bool fill) {
+  if (w <= 0 || h <= 0)
+    return;
+  uint64_t span = RowMask(y, y + h - 1);
+  // the top and bottom edge, rows outside the screen drop out of the mask
+  uint64_t edges = span & (RowMask(y, y) | RowMask(y + h - 1, y + h - 1));
+  int x1 = std::min(x + w - 1, (int)G13_LCD_COLUMNS - 1);
+  for (int col = std::max(x, 0); col <= x1; col++) {
+    ColumnOp(col, fill || col == x || col == x + w - 1 ? span : edges, color);
+  }
+}
+
+void G13_LCD::Circle(int cx, int cy, int r, int color, bool fill) {
+  if (r < 0)
+    return;
+  // midpoint circle, every octant point mirrored once; filled circles
+  // are a column span from the top to the bottom half for every x
+  uint64_t spans[G13_LCD_COLUMNS]{};
+  auto plot = [&](int x, int y0, int y1) {
+    if (x >= 0 && x < (int)G13_LCD_COLUMNS)
+      spans[x] |= fill ? RowMask(y0, y1) : RowMask(y0, y0) | RowMask(y1, y1);
+  };
+  int x = r, y = 0, error = 1 - r;
+  while (x >= y) {
+    plot(cx + x, cy - y, cy + y);
+    plot(cx - x, cy - y, cy + y);
+    plot(cx + y, cy - x, cy + x);
+    plot(cx - y, cy - x, cy + x);
+    y++;
+    if (error < 0) {
+      error += 2 * y + 1;
+    } else {
+      x--;
+      error += 2 * (y - x) + 1;
+    }
+  }
+  int x1 = std::min(cx + r, (int)G13_LCD_COLUMNS - 1);
+  for (int col = std::max(cx - r, 0); col <= x1; col++) {
+    ColumnOp(col, spans[col], color);
+  }
+}
+
+void G13_LCD::Arc(int cx, int cy, int r, int start, int end, int color) {
+  if (r <= 0)
+    return;
+  while (end < start)
+    end += 360;
+  end = std::min(end, start + 360);
+  // steps of half a pixel along the arc, each pixel drawn once
+  double step = 0.5 / r;
+  double from = start * M_PI / 180, to = end * M_PI / 180;
+  uint64_t columns[G13_LCD_COLUMNS]{};
+  for (double a = from; a <= to + step / 2; a += step) {
+    int x = (int)lround(cx + r * sin(std::min(a, to)));
+    int y = (int)lround(cy - r * cos(std::min(a, to)));
+    if (x >= 0 && x < (int)G13_LCD_COLUMNS)
+      columns[x] |= RowMask(y, y);
+  }
+  for (unsigned col = 0; col < G13_LCD_COLUMNS; col++) {
+    ColumnOp((int)col, columns[col], color);
+  }
+}
+
+void G13_LCD::Blit(const G13_LcdImage &image, int x, int y, G13_LcdBlit mode) {
+  if (y >= (int)G13_LCD_ROWS || y <= -(int)image.height)
+    return;
+  uint64_t mask = RowMask(y, y + (int)image.height - 1);
+  for (unsigned i = 0; i < image.width; i++) {
+    int col = x + (int)i;
+    if (col < 0 || col >= (int)G13_LCD_COLUMNS)
+      continue;
+    uint64_t bits = y >= 0 ? image.columns[i] << y : image.columns[i] >> -y;
+    if (mode == G13_BLIT_COPY) {
+      SetColumn(col, bits, mask);
+    } else if (mode == G13_BLIT_OR) {
+      SetColumn(col, bits, bits & mask);
+    } else {
+      SetColumn(col, ~Column(col), bits & mask);
+    }
+  }
+}
+
+unsigned G13_LCD::DrawText(int x, int y, const std::string &text,
+                           G13_Font &font, bool inverted) {
+  if (y >= (int)G13_LCD_ROWS || y <= -(int)G13_LCD_TEXT_CHEIGHT)
+    return text.size() * font.width();
+  uint64_t mask = RowMask(y, y + G13_LCD_TEXT_CHEIGHT - 1);
+  int col = x;
+  for (unsigned char c : text) {
+    auto &bits = font.char_data(c);
+    for (unsigned i = 0; i < font.width(); i++, col++) {
+      if (col < 0 || col >= (int)G13_LCD_COLUMNS)
+        continue;
+      uint64_t column =
+          inverted ? bits.bits_inverted[i] : bits.bits_regular[i];
+      SetColumn(col, y >= 0 ? column << y : column >> -y, mask);
+    }
+  }
+  return col - x;
+}
+
+G13_LcdImage G13_LcdImage::Load(const std::string &filename) {
+  std::ifstream file(filename, std::ios::binary);
+  std::string data((std::istreambuf_iterator<char>(file)),
+                   std::istreambuf_iterator<char>());
+  if (!file) {
+    throw G13_CommandException("cannot read image " + filename);
+  }
+
+  G13_LcdImage image;
+  // a screen in G13 layout, as written by pbm2lpbm
+  if (data.size() == G13_LCD_BUF_SIZE) {
+    image.width = G13_LCD_COLUMNS;
+    image.height = G13_LCD_ROWS;
+    image.columns.resize(image.width);
+    for (unsigned x = 0; x < image.width; x++) {
+      for (unsigned page = 0; page < G13_LCD_ROWS / 8; page++) {
+        image.columns[x] |=
+            (uint64_t)(unsigned char)data[x + page * G13_LCD_COLUMNS]
+            << (page * 8);
+      }
+    }
+    return image;
+  }
+
+  // a binary pbm (P4) of any size up to G13_LCD_ROWS rows
+  size_t pos = 2;
+  auto number = [&]() {
+    while (pos < data.size() && (isspace(data[pos]) || data[pos] == '#')) {
+      if (data[pos] == '#')
+        pos = data.find('\n', pos);
+      else
+        pos++;
+    }
+    unsigned value = 0;
+    while (pos < data.size() && isdigit(data[pos]))
+      value = value * 10 + (data[pos++] - '0');
+    return value;
+  };
+  if (data.compare(0, 2, "P4")) {
+    throw G13_CommandException(filename + " is neither pbm (P4) nor lpbm");
+  }
+  image.width = number();
+  image.height = number();
+  pos++;
+  size_t stride = (image.width + 7) / 8;
+  if (!image.width || !image.height || image.height > G13_LCD_ROWS ||
+      data.size() < pos + stride * image.height) {
+    throw G13_CommandException("bad pbm image " + filename);
+  }
+  image.columns.resize(image.width);
+  for (unsigned y = 0; y < image.height; y++) {
+    auto row = reinterpret_cast<const unsigned char *>(&data[pos + y * stride]);
+    for (unsigned x = 0; x < image.width; x++) {
+      if (row[x / 8] & (0x80 >> (x % 8)))
+        image.columns[x] |= 1ull << y;
+    }
+  }
+  return image;
+}
+
+// *************************************************************************
+
+void G13_LCD::ShareStart(const std::string &socket_name) {
+  m_share_memfd = memfd_create("g13-lcd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (m_share_memfd < 0 ||
+      ftruncate(m_share_memfd, sizeof(G13_LcdShared)) < 0) {
+    G13_ERR("Cannot create shared LCD framebuffer: " << strerror(errno));
+    ShareStop();
+    return;
+  }
+  // clients must not be able to pull the memory from under us
+  fcntl(m_share_memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+  void *map = mmap(nullptr, sizeof(G13_LcdShared), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, m_share_memfd, 0);
+  if (map == MAP_FAILED) {
+    G13_ERR("Cannot map shared LCD framebuffer: " << strerror(errno));
+    ShareStop();
+    return;
+  }
+  m_shared = new (map) G13_LcdShared{};
+  m_shared->magic = G13_LCD_SHARED_MAGIC;
+  m_shared->version = G13_LCD_SHARED_VERSION;
+
+  m_share_doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (m_share_doorbell < 0 || socket_name.size() >= sizeof(addr.sun_path)) {
+    G13_ERR("Cannot create LCD socket " << socket_name);
+    ShareStop();
+    return;
+  }
+  strcpy(addr.sun_path, socket_name.c_str());
+  unlink(socket_name.c_str());
+  m_share_socket =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (m_share_socket < 0 ||
+      bind(m_share_socket, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(m_share_socket, 4) < 0) {
+    G13_ERR("Cannot create LCD socket " << socket_name << ": "
+                                        << strerror(errno));
+    ShareStop();
+    return;
+  }
+  m_share_socket_name = socket_name;
+  mode_t umask = std::stoi(
+      "0" + G13_Manager::Instance()->getStringConfigValue("umask"), nullptr, 8);
+  chmod(socket_name.c_str(), 0777 & ~(umask | S_IXUSR | S_IXGRP | S_IXOTH));
+
+  G13_Manager::WatchFd(m_share_socket, EPOLLIN,
+                       [this](uint32_t) { ShareAccept(); });
+  G13_Manager::WatchFd(m_share_doorbell, EPOLLIN,
+                       [this](uint32_t) { ShareDoorbell(); });
+}
+
+void G13_LCD::ShareStop() {
+  if (m_share_socket >= 0) {
+    G13_Manager::UnwatchFd(m_share_socket);
+    close(m_share_socket);
+    m_share_socket = -1;
+  }
+  if (!m_share_socket_name.empty()) {
+    unlink(m_share_socket_name.c_str());
+    m_share_socket_name.clear();
+  }
+  if (m_share_doorbell >= 0) {
+    G13_Manager::UnwatchFd(m_share_doorbell);
+    close(m_share_doorbell);
+    m_share_doorbell = -1;
+  }
+  if (m_shared) {
+    munmap(m_shared, sizeof(G13_LcdShared));
+    m_shared = nullptr;
+  }
+  if (m_share_memfd >= 0) {
+    close(m_share_memfd);
+    m_share_memfd = -1;
+  }
+}
+
+// sends the framebuffer and doorbell to a new client, along with the size
+void G13_LCD::ShareAccept() {
+  int client = accept4(m_share_socket, nullptr, nullptr, SOCK_CLOEXEC);
+  if (client < 0)
+    return;
+
+  uint32_t size = sizeof(G13_LcdShared);
+  iovec iov{&size, sizeof(size)};
+  int fds[2] = {m_share_memfd, m_share_doorbell};
+  char control[CMSG_SPACE(sizeof(fds))]{};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(client, &msg, MSG_NOSIGNAL) < 0) {
+    G13_ERR("Cannot pass LCD framebuffer: " << strerror(errno));
+  }
+  close(client);
+}
+
+void G13_LCD::ShareDoorbell() {
+  uint64_t rings;
+  if (read(m_share_doorbell, &rings, sizeof(rings)) != sizeof(rings))
+    return;
+  // only the latest frame matters, however often the bell was rung
+  uint32_t frame;
+  do {
+    frame = m_shared->ready.load() & 1;
+    m_shared->in_use.store(frame + 1);
+  } while ((m_shared->ready.load() & 1) != frame);
+  Image(m_shared->frames[frame], G13_LCD_BUF_SIZE);
+  m_shared->in_use.store(0, std::memory_order_release);
+}
+
 } // namespace G13
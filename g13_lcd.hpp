@@ -5,22 +5,84 @@
 #ifndef G13_G13_LCD_HPP
 #define G13_G13_LCD_HPP
 
+#include <atomic>
+#include <cstdint>
 #include <cstring>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace G13 {
 class G13_Device;
+class G13_Font;
 
 const size_t G13_LCD_BUFFER_SIZE = 0x3c0;
+// an image as sent to the keypad, after a 32 byte header
+const size_t G13_LCD_TRANSFER_SIZE = G13_LCD_BUFFER_SIZE + 32;
 const size_t G13_LCD_COLUMNS = 160;
 const size_t G13_LCD_ROWS = 48;
 const size_t G13_LCD_BYTES_PER_ROW = G13_LCD_COLUMNS / 8;
 const size_t G13_LCD_BUF_SIZE = G13_LCD_ROWS * G13_LCD_BYTES_PER_ROW;
+
+// largest coordinate, size or angle and largest radius the drawing commands
+// take, so that no command keeps the event loop busy for long
+const int G13_LCD_DRAW_LIMIT = 1024;
+const int G13_LCD_RADIUS_LIMIT = 256;
 const size_t G13_LCD_TEXT_CHEIGHT = 8;
 const size_t G13_LCD_TEXT_ROWS = 160 / G13_LCD_TEXT_CHEIGHT;
+// frames sent per second at most, unless configured by lcd_fps
+const unsigned G13_LCD_DEFAULT_FPS = 30;
+
+/*
+ * Framebuffer shared with clients of the LCD socket. A client draws into
+ * the frame ready does not point at, stores its index in ready and writes
+ * 1 to the doorbell eventfd; the daemon then sends that frame.
+ *
+ * The daemon marks the frame it copies in in_use. Before drawing into a
+ * frame, the client waits for in_use to point elsewhere, as it may still
+ * be copying a frame the client flipped away from. Both sides store
+ * their index before loading the other's, with sequentially consistent
+ * atomics, so at least one of them notices the other.
+ */
+const uint32_t G13_LCD_SHARED_MAGIC = 0x4c333147; // "G13L"
+const uint32_t G13_LCD_SHARED_VERSION = 2;
+
+struct G13_LcdShared {
+  uint32_t magic;
+  uint32_t version;
+  std::atomic<uint32_t> ready;  // 0 or 1, the frame to send next
+  std::atomic<uint32_t> in_use; // 1 + frame being copied, 0 when none
+  unsigned char frames[2][G13_LCD_BUF_SIZE]; // G13 layout
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+              "the shared frame index needs lock free atomics");
+
+// colours of the drawing primitives
+enum G13_LcdColor { G13_LCD_CLEAR = 0, G13_LCD_SET = 1, G13_LCD_INVERT = 2 };
+
+enum G13_LcdBlit {
+  G13_BLIT_COPY, // the image replaces what is under it
+  G13_BLIT_OR,   // only set pixels are drawn
+  G13_BLIT_XOR,  // set pixels invert what is under them
+};
+
+/*!
+ * image for blitting, stored as columns like the screen is drawn
+ */
+struct G13_LcdImage {
+  unsigned width = 0;
+  unsigned height = 0;
+  std::vector<uint64_t> columns; // bit n is row n
+
+  // reads a pbm (P4) or lpbm file, throws G13_CommandException
+  static G13_LcdImage Load(const std::string &filename);
+};
 
 class G13_LCD {
 public:
   explicit G13_LCD(G13_Device &keypad);
+  ~G13_LCD();
 
   G13_Device &m_keypad;
   unsigned char image_buf[G13_LCD_BUF_SIZE + 8];
@@ -28,8 +90,25 @@ public:
   unsigned cursor_col;
   int text_mode;
 
+  // copies an image in G13 layout to image_buf and sends it
   void Image(unsigned char *data, int size);
-  void image_send() { Image(image_buf, G13_LCD_BUF_SIZE); }
+
+  /*!
+   * marks image_buf for sending. Frames are sent at most lcd_fps times a
+   * second, later changes within a frame interval going out together at
+   * its end, and only when they differ from the frame sent last.
+   */
+  void image_send();
+  // sends image_buf even when the keypad should already show it
+  void image_refresh();
+  // sends image_buf now if it is marked
+  void Flush();
+  /*
+   * the keypad may not show the frame last sent, because sending it failed
+   * or something else was written to the LCD; the next frame goes out even
+   * when unchanged
+   */
+  void ForgetSent() { m_sent_valid = false; }
 
   // void image_test(int x, int y);
   void image_clear() { memset(image_buf, 0, G13_LCD_BUF_SIZE); }
@@ -44,6 +123,59 @@ public:
   void WriteChar(char c, unsigned int row = -1, unsigned int col = -1);
   void WriteString(const char *str);
   void WritePos(int row, int col);
+
+  // drawing into image_buf, x is the column and y the row, clipped to the
+  // screen; color is one of G13_LcdColor
+  void Pixel(int x, int y, int color = G13_LCD_SET);
+  void Line(int x0, int y0, int x1, int y1, int color = G13_LCD_SET);
+  void Rect(int x, int y, int w, int h, int color = G13_LCD_SET,
+            bool fill = false);
+  void Circle(int cx, int cy, int r, int color = G13_LCD_SET,
+              bool fill = false);
+  // start and end are degrees clockwise from 12 o'clock, at most a full
+  // circle apart
+  void Arc(int cx, int cy, int r, int start, int end,
+           int color = G13_LCD_SET);
+  void Blit(const G13_LcdImage &image, int x, int y,
+            G13_LcdBlit mode = G13_BLIT_COPY);
+  // text at any pixel position, returns its width in pixels
+  unsigned DrawText(int x, int y, const std::string &text, G13_Font &font,
+                    bool inverted = false);
+
+  // images for blit, by name
+  std::map<std::string, G13_LcdImage> images;
+
+  // hands out the shared framebuffer on a unix socket at socket_name
+  void ShareStart(const std::string &socket_name);
+  void ShareStop();
+
+protected:
+  // all pixels of column x, bit n being row n
+  [[nodiscard]] uint64_t Column(unsigned x) const;
+  // replaces the bits of column x selected by mask
+  void SetColumn(unsigned x, uint64_t bits, uint64_t mask);
+  void ColumnOp(int x, uint64_t mask, int color);
+
+  void ShareAccept();
+  void ShareDoorbell();
+
+  // flushes after delay ns
+  void ArmFlush(uint64_t delay);
+
+  bool m_dirty = false;
+  // the frame last sent, when m_sent_valid
+  unsigned char m_sent[G13_LCD_BUF_SIZE]{};
+  bool m_sent_valid = false;
+  uint64_t m_last_send = 0;
+  uint64_t m_frame_interval; // ns
+  int m_flush_timer = -1;
+  bool m_flush_armed = false;
+
+  std::string m_share_socket_name;
+  int m_share_socket = -1;
+  int m_share_memfd = -1;
+  int m_share_doorbell = -1;
+  G13_LcdShared *m_shared = nullptr;
 };
 } // namespace G13
 #endif // G13_G13_LCD_HPP
@@ -20,6 +20,20 @@ void printHelp() {
               << "specify name for output pipe" << std::endl;
     std::cout << std::left << std::setw(indent) << "  --umask <octal>"
               << "specify umask for pipes creation" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --lcd_socket <name>"
+              << "specify name for shared LCD framebuffer socket" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --lcd_fps <n>"
+              << "LCD frames sent per second at most (0: no limit)" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --bare_images <on|off>"
+              << "take 960 byte pipe reads for LCD images (default on)" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --control_socket <name>"
+              << "specify name for the control socket" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --key_transfers <n>"
+              << "number of key reports queued per device" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --replay <file>"
+              << "replay recorded key reports instead of using a G13" << std::endl;
+    std::cout << std::left << std::setw(indent) << "  --replay_speed <speed>"
+              << "original (default) or max" << std::endl;
     std::cout << std::left << std::setw(indent) << "  --log_level <level>"
               << "logging level" << std::endl;
 //    std::cout << std::left << std::setw(indent) << "--log_file <file>"
@@ -34,13 +48,20 @@ int main(int argc, char* argv[]) {
     G13_OUT("g13d v" << GIT_VERSION << " " << __DATE__ << " " << __TIME__);
 
     // TODO: move out argument parsing
-    const char* const short_opts = "l:c:i:o:u:d:h";
+    const char* const short_opts = "l:c:i:o:u:L:F:b:C:k:r:s:d:h";
     const option long_opts[] = {
         {"logo", required_argument, nullptr, 'l'},
         {"config", required_argument, nullptr, 'c'},
         {"pipe_in", required_argument, nullptr, 'i'},
         {"pipe_out", required_argument, nullptr, 'o'},
         {"umask", required_argument, nullptr, 'u'},
+        {"lcd_socket", required_argument, nullptr, 'L'},
+        {"lcd_fps", required_argument, nullptr, 'F'},
+        {"bare_images", required_argument, nullptr, 'b'},
+        {"control_socket", required_argument, nullptr, 'C'},
+        {"key_transfers", required_argument, nullptr, 'k'},
+        {"replay", required_argument, nullptr, 'r'},
+        {"replay_speed", required_argument, nullptr, 's'},
         {"log_level", required_argument, nullptr, 'd'},
         //                                {"log_file", required_argument, nullptr, 'f'},
         {"help", no_argument, nullptr, 'h'},
@@ -74,6 +95,34 @@ int main(int argc, char* argv[]) {
               G13_Manager::Instance()->setStringConfigValue("umask", std::string(optarg));
                 break;
 
+            case 'L':
+              G13_Manager::Instance()->setStringConfigValue("lcd_socket", std::string(optarg));
+                break;
+
+            case 'F':
+              G13_Manager::Instance()->setStringConfigValue("lcd_fps", std::string(optarg));
+                break;
+
+            case 'b':
+              G13_Manager::Instance()->setStringConfigValue("bare_images", std::string(optarg));
+                break;
+
+            case 'C':
+              G13_Manager::Instance()->setStringConfigValue("control_socket", std::string(optarg));
+                break;
+
+            case 'k':
+              G13_Manager::Instance()->setStringConfigValue("key_transfers", std::string(optarg));
+                break;
+
+            case 'r':
+              G13_Manager::Instance()->setStringConfigValue("replay", std::string(optarg));
+                break;
+
+            case 's':
+              G13_Manager::Instance()->setStringConfigValue("replay_speed", std::string(optarg));
+                break;
+
             case 'd':
               G13_Manager::Instance()->setStringConfigValue("log_level", std::string(optarg));
             G13_Manager::Instance()->SetLogLevel(
@@ -18,6 +18,8 @@ bool G13_Manager::running = true;
 std::map<std::string, std::string> G13_Manager::stringConfigValues;
 libusb_context *G13_Manager::libusbContext;
 std::vector<G13::G13_Device *> G13_Manager::g13s;
+std::vector<G13::G13_Device *> G13_Manager::pendingSetup;
+std::vector<G13::G13_Device *> G13_Manager::pendingRemoval;
 libusb_hotplug_callback_handle G13_Manager::hotplug_cb_handle[3];
 const int G13_Manager::class_id = LIBUSB_HOTPLUG_MATCH_ANY;
 
@@ -45,6 +47,14 @@ void G13_Manager::Cleanup() {
     // g13->Cleanup();
     delete g13;
   }
+  g13s.clear();
+  pendingSetup.clear();
+  for (auto g13 : pendingRemoval) {
+    delete g13;
+  }
+  pendingRemoval.clear();
+  CleanupControlSocket();
+  CleanupEventLoop();
   libusb_exit(libusbContext);
 }
 
@@ -87,6 +97,8 @@ void G13_Manager::InitKeynames() {
   }
 }
 
+void G13_Manager::Stop() { running = false; }
+
 void G13_Manager::SignalHandler(int signal) {
   G13_OUT("Caught signal " << signal << " (" << strsignal(signal) << ")");
   running = false;
@@ -107,21 +119,23 @@ void G13_Manager::setStringConfigValue(const std::string &name,
   stringConfigValues[name] = value;
 }
 
-std::string G13_Manager::MakePipeName(G13::G13_Device *d, bool is_input) {
-  auto pipename = [&](const char *param, const char *suffix) -> std::string {
-    std::string config_base = getStringConfigValue(param);
-    if (!config_base.empty()) {
-      if (d->id_within_manager() == 0)
-        return config_base;
-      return config_base + "-" + std::to_string(d->id_within_manager());
-    }
-    return std::string(CONTROL_DIR) + "/g13-" +
-           std::to_string(d->id_within_manager()) + suffix;
-  };
+std::string G13_Manager::MakeControlName(G13::G13_Device *d,
+                                         const char *param,
+                                         const char *suffix) {
+  std::string config_base = getStringConfigValue(param);
+  if (!config_base.empty()) {
+    if (d->id_within_manager() == 0)
+      return config_base;
+    return config_base + "-" + std::to_string(d->id_within_manager());
+  }
+  return std::string(CONTROL_DIR) + "/g13-" +
+         std::to_string(d->id_within_manager()) + suffix;
+}
 
+std::string G13_Manager::MakePipeName(G13::G13_Device *d, bool is_input) {
   if (is_input)
-    return pipename("pipe_in", "");
-  return pipename("pipe_out", "_out");
+    return MakeControlName(d, "pipe_in", "");
+  return MakeControlName(d, "pipe_out", "_out");
 }
 
 G13::LINUX_KEY_VALUE G13_Manager::FindG13KeyValue(const std::string &keyname) {
@@ -190,7 +204,22 @@ int G13_Manager::Run() {
   }
   libusb_set_option(libusbContext, LIBUSB_OPTION_LOG_LEVEL, 3);
 
-  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+  if (!InitEventLoop()) {
+    Cleanup();
+    return EXIT_FAILURE;
+  }
+  // the pipes still work without it
+  if (!InitControlSocket()) {
+    G13_ERR("Running without a control socket");
+  }
+
+  auto replay = getStringConfigValue("replay");
+  if (!replay.empty()) {
+    if (!OpenReplayDevice(replay)) {
+      Cleanup();
+      return EXIT_FAILURE;
+    }
+  } else if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
     cnt = libusb_get_device_list(libusbContext, &devs);
     if (cnt < 0) {
       G13_ERR("Error while getting device list");
@@ -210,42 +239,21 @@ int G13_Manager::Run() {
     ArmHotplugCallbacks();
   }
 
-  signal(SIGINT, SignalHandler);
-  signal(SIGTERM, SignalHandler);
-
-  for (auto g13 : g13s) {
-    // This can not be done from the event handler (will give LIBUSB_ERROR_BUSY)
-    SetupDevice(g13);
-  }
-
+  // Main loop
+  bool waiting = false;
   do {
-    if (g13s.empty()) {
-      G13_OUT("Waiting for device to show up ...");
-      error = libusb_handle_events(libusbContext);
-      G13_DBG("USB Event wakeup with " << g13s.size() << " devices registered");
-      if (error != LIBUSB_SUCCESS) {
-        G13_ERR("Error: " << G13_Device::DescribeLibusbErrorCode(error));
-      } else {
-        for (auto g13 : g13s) {
-          // This can not be done from the event handler (will give
-          // LIBUSB_ERROR_BUSY)
-          SetupDevice(g13);
-        }
+    // This can not be done from the hotplug handlers (will give
+    // LIBUSB_ERROR_BUSY)
+    ProcessPendingDevices();
+
+    if (g13s.empty() != waiting) {
+      waiting = g13s.empty();
+      if (waiting) {
+        G13_OUT("Waiting for device to show up ...");
       }
     }
 
-    // Main loop
-    for (auto g13 : g13s) {
-      int status = g13->ReadKeypresses();
-      if (!g13s.empty()) {
-        // Cleanup might have removed the object before this loop has run
-        // TODO: This will not work with multiplt devices and can be better
-        g13->ReadCommandsFromPipe();
-      };
-      if (status < 0) {
-        running = false;
-      }
-    }
+    DispatchEvents();
   } while (running);
 
   Cleanup();
@@ -11,6 +11,8 @@
 #include "g13_keys.hpp"
 #include "g13_log.hpp"
 #include "g13_manager.hpp"
+#include <deque>
+#include <functional>
 #include <libusb-1.0/libusb.h>
 
 #ifndef CONTROL_DIR
@@ -22,6 +24,9 @@
  */
 namespace G13 {
 class G13_Manager {
+public:
+  typedef std::function<void(uint32_t events)> FdHandler;
+
 private:
   G13_Manager();
 
@@ -30,6 +35,8 @@ private:
   static std::map<std::string, std::string> stringConfigValues;
   static libusb_context *libusbContext;
   static std::vector<G13::G13_Device *> g13s;
+  static std::vector<G13::G13_Device *> pendingSetup;
+  static std::vector<G13::G13_Device *> pendingRemoval;
   static libusb_hotplug_callback_handle hotplug_cb_handle[3];
   static std::map<G13_KEY_INDEX, std::string> g13_key_to_name;
   static std::map<std::string, G13_KEY_INDEX> g13_name_to_key;
@@ -39,6 +46,12 @@ private:
   static libusb_device **devs;
   static std::string logoFilename;
   static const int class_id;
+  static int epollFd;
+  static int signalFd;
+  static std::map<int, FdHandler> fdHandlers;
+  static int controlSocket;
+  static std::string controlSocketName;
+  static std::map<int, std::deque<std::string>> controlClients;
 
 public:
   static G13_Manager *
@@ -60,6 +73,8 @@ public:
 
   static int Run();
 
+  static void Stop();
+
   [[nodiscard]] static std::string
   getStringConfigValue(const std::string &name);
 
@@ -68,6 +83,10 @@ public:
 
   static std::string MakePipeName(G13::G13_Device *d, bool is_input);
 
+  // name of a per device file, configured by param or in CONTROL_DIR
+  static std::string MakeControlName(G13::G13_Device *d, const char *param,
+                                     const char *suffix);
+
   static void start_logging();
 
   [[maybe_unused]] static void
@@ -75,6 +94,15 @@ public:
 
   static void SetLogLevel(const std::string &level);
 
+  // event loop, see g13_eventloop.cpp
+  static bool WatchFd(int fd, uint32_t events, FdHandler handler);
+
+  static void UnwatchFd(int fd);
+
+  static int AddTimer(unsigned int interval_ms, std::function<void()> callback);
+
+  static void RemoveTimer(int timer);
+
 protected:
   static void InitKeynames();
 
@@ -105,7 +133,41 @@ protected:
 
   static int OpenAndAddG13(libusb_device *dev);
 
+  static bool OpenReplayDevice(const std::string &filename);
+
   static void ArmHotplugCallbacks();
+
+  static void ProcessPendingDevices();
+
+  static bool InitEventLoop();
+
+  static void CleanupEventLoop();
+
+  static void DispatchEvents();
+
+  static void HandleUsbEvents();
+
+  static void LIBUSB_CALL PollfdAdded(int fd, short events, void *user_data);
+
+  static void LIBUSB_CALL PollfdRemoved(int fd, void *user_data);
+
+  // control socket, see g13_control.cpp
+  static bool InitControlSocket();
+
+  static void CleanupControlSocket();
+
+  static void ControlAccept();
+
+  static void ControlEvents(int client, uint32_t events);
+
+  static void ControlDrop(int client);
+
+  static void ControlReply(int client, std::string reply);
+
+  static std::string ControlRequest(int client, const char *request);
+
+  static std::string ControlSubscribe(int client, G13::G13_Device &g13,
+                                      const char *args);
 };
 } // namespace G13
 
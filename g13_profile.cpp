@@ -32,6 +32,12 @@ void G13_Profile::_init_keys() {
     G13_Key *key = FindKey(*symbol);
     key->_should_parse = false;
   }
+
+  for (auto &key : _keys) {
+    if (key._should_parse) {
+      _parse_mask |= 1ull << key.index();
+    }
+  }
 }
 
 void G13_Profile::dump(std::ostream &o) const {
@@ -45,13 +51,33 @@ void G13_Profile::dump(std::ostream &o) const {
   }
 }
 
-void G13_Profile::ParseKeys(unsigned char *buf) {
-  buf += 3;
-  for (auto &_key : _keys) {
-    if (_key._should_parse) {
-      _key.ParseKey(buf, &_keypad);
+/*! dispatches the keys that changed since the previous report
+ *
+ * Bytes 3 to 7 of a report hold one bit per key, in G13_KEY_STRINGS order.
+ */
+void G13_Profile::ParseKeys(const unsigned char *buf) {
+  uint64_t state = (uint64_t)buf[3] | (uint64_t)buf[4] << 8 |
+                   (uint64_t)buf[5] << 16 | (uint64_t)buf[6] << 24 |
+                   (uint64_t)buf[7] << 32;
+  uint64_t changed = _keypad.UpdateKeyState(state & _parse_mask);
+  if (!changed)
+    return;
+
+  auto start = G13_Stats::Now();
+  do {
+    int index = __builtin_ctzll(changed);
+    changed &= changed - 1;
+    auto &action = _keys[index]._action;
+    if (action) {
+      action->act(_keypad, state & (1ull << index));
     }
-  }
+    if (_keypad.events().wants(G13_EVENT_KEY)) {
+      _keypad.PublishEvent(G13_EVENT_KEY,
+                           _keys[index].name() +
+                               (state & (1ull << index) ? " down\n" : " up\n"));
+    }
+  } while (changed);
+  _keypad.stats().parse_keys.record(G13_Stats::Now() - start);
 }
 
 G13_Key *G13_Profile::FindKey(const std::string &keyname) {
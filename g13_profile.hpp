@@ -26,8 +26,8 @@ public:
   }
 
   G13_Profile(const G13_Profile &other, std::string name_arg)
-      : _keypad(other._keypad), _keys(other._keys), _name(std::move(name_arg)) {
-  }
+      : _keypad(other._keypad), _keys(other._keys), _name(std::move(name_arg)),
+        _parse_mask(other._parse_mask) {}
 
   // search key by G13 keyname
   G13::G13_Key *FindKey(const std::string &keyname);
@@ -37,7 +37,7 @@ public:
 
   void dump(std::ostream &o) const;
 
-  void ParseKeys(unsigned char *buf);
+  void ParseKeys(const unsigned char *buf);
 
   [[nodiscard]] const std::string &name() const { return _name; }
 
@@ -47,6 +47,8 @@ protected:
   G13::G13_Device &_keypad;
   std::vector<G13::G13_Key> _keys;
   std::string _name;
+  // keys whose state changes are dispatched, G13_NONPARSED_KEYS are left out
+  uint64_t _parse_mask = 0;
 
   void _init_keys();
 };
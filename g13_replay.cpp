@@ -0,0 +1,295 @@
+//
+// Transport replaying recorded key reports, for testing and benchmarking
+// without a keypad
+//
+
+#include "g13_replay.hpp"
+#include "g13_device.hpp"
+#include "g13_manager.hpp"
+#include <fcntl.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace G13 {
+
+// raw reports carry no time stamps, space them like a busy keypad would
+static const uint64_t G13_REPLAY_RAW_INTERVAL = 10000000; // 10 ms
+// reports handled per loop iteration, so pipe commands still get through
+static const size_t G13_REPLAY_BATCH = 256;
+
+int G13_ReplayTransport::active = 0;
+
+G13_ReplayTransport::G13_ReplayTransport(std::vector<G13_ReplayReport> reports,
+                                         bool realtime)
+    : m_reports(std::move(reports)), m_next(0), m_realtime(realtime),
+      m_timer(-1), m_start(0), m_lcd_frames(0), m_set_report_count(0) {}
+
+G13_ReplayTransport::~G13_ReplayTransport() { StopKeyReader(); }
+
+std::vector<G13_ReplayReport>
+G13_ReplayTransport::LoadReports(const std::string &filename) {
+  std::vector<G13_ReplayReport> reports;
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    G13_ERR("Cannot open replay file " << filename << ": " << strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return reports;
+  }
+  size_t size = st.st_size;
+  if (size == 0) {
+    close(fd);
+    return reports;
+  }
+  void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    G13_ERR("Cannot map replay file " << filename << ": " << strerror(errno));
+    return reports;
+  }
+  auto bytes = static_cast<const unsigned char *>(map);
+
+  auto header = reinterpret_cast<const G13_CaptureHeader *>(bytes);
+  size_t trailing;
+  if (size >= sizeof(G13_CaptureHeader) &&
+      !memcmp(header->magic, G13_CAPTURE_MAGIC, sizeof(G13_CAPTURE_MAGIC))) {
+    if (header->version != G13_CAPTURE_VERSION ||
+        header->record_size != sizeof(G13_ReplayReport)) {
+      G13_ERR("Unsupported capture file " << filename << " (version "
+                                          << header->version << ", record size "
+                                          << header->record_size << ")");
+      munmap(map, size);
+      return reports;
+    }
+    auto records =
+        reinterpret_cast<const G13_ReplayReport *>(bytes + sizeof(*header));
+    size_t count = (size - sizeof(*header)) / sizeof(G13_ReplayReport);
+    trailing = (size - sizeof(*header)) % sizeof(G13_ReplayReport);
+    reports.assign(records, records + count);
+    // start replaying with the first report, not when recording started
+    if (!reports.empty()) {
+      uint64_t first = reports[0].time;
+      for (auto &report : reports) {
+        report.time = report.time > first ? report.time - first : 0;
+      }
+    }
+  } else {
+    size_t count = size / G13_REPORT_SIZE;
+    trailing = size % G13_REPORT_SIZE;
+    reports.resize(count);
+    for (size_t i = 0; i < count; i++) {
+      reports[i].time = i * G13_REPLAY_RAW_INTERVAL;
+      memcpy(reports[i].data, bytes + i * G13_REPORT_SIZE, G13_REPORT_SIZE);
+    }
+  }
+  munmap(map, size);
+
+  if (trailing) {
+    G13_ERR("Ignoring " << trailing << " trailing bytes in " << filename);
+  }
+  return reports;
+}
+
+int G13_ReplayTransport::WriteLcd(const unsigned char *data) {
+  memcpy(m_lcd_frame, data, G13_LCD_BUFFER_SIZE);
+  m_lcd_frames++;
+  G13_Stats::count(m_g13->stats().lcd_transfers);
+  return LIBUSB_SUCCESS;
+}
+
+int G13_ReplayTransport::SetReport(uint16_t value, unsigned char *data,
+                                   uint16_t size) {
+  m_reports_set[value].assign(data, data + size);
+  m_set_report_count++;
+  G13_Stats::count(m_g13->stats().control_transfers);
+  return LIBUSB_SUCCESS;
+}
+
+void G13_ReplayTransport::StartKeyReader() {
+  if (m_timer >= 0)
+    return;
+  m_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (m_timer < 0) {
+    G13_ERR("Cannot create replay timer: " << strerror(errno));
+    return;
+  }
+  G13_Manager::WatchFd(m_timer, EPOLLIN, [this](uint32_t) {
+    uint64_t expirations;
+    if (read(m_timer, &expirations, sizeof(expirations)) > 0) {
+      Feed();
+    }
+  });
+
+  G13_OUT("Replaying " << m_reports.size() << " reports"
+                       << (m_realtime ? "" : " at maximum speed"));
+  active++;
+  m_start = G13_Stats::Now();
+  m_g13->stats().reset();
+  Arm(m_reports.empty() ? 0 : m_reports[0].time);
+}
+
+void G13_ReplayTransport::StopKeyReader() {
+  if (m_timer < 0)
+    return;
+  G13_Manager::UnwatchFd(m_timer);
+  close(m_timer);
+  m_timer = -1;
+}
+
+void G13_ReplayTransport::Arm(uint64_t delay) {
+  itimerspec spec{};
+  // a zero value would disarm the timer
+  delay = std::max<uint64_t>(delay, 1);
+  spec.it_value.tv_sec = delay / 1000000000;
+  spec.it_value.tv_nsec = delay % 1000000000;
+  timerfd_settime(m_timer, 0, &spec, nullptr);
+}
+
+void G13_ReplayTransport::Feed() {
+  uint64_t elapsed = G13_Stats::Now() - m_start;
+
+  for (size_t batch = 0;
+       m_next < m_reports.size() && batch < G13_REPLAY_BATCH; batch++) {
+    auto &report = m_reports[m_next];
+    if (m_realtime && report.time > elapsed)
+      break;
+    m_g13->ReadKeypresses(report.data);
+    m_next++;
+  }
+
+  if (m_next == m_reports.size()) {
+    Finished();
+  } else if (m_realtime && m_reports[m_next].time > elapsed) {
+    Arm(m_reports[m_next].time - elapsed);
+  } else {
+    Arm(0);
+  }
+}
+
+void G13_ReplayTransport::Finished() {
+  StopKeyReader();
+
+  double elapsed = (double)(G13_Stats::Now() - m_start) / 1e9;
+  std::ostringstream o;
+  o << "Replay finished: " << m_reports.size() << " reports in " << elapsed
+    << " s (" << (elapsed > 0 ? (double)m_reports.size() / elapsed : 0.0)
+    << " reports/s)" << std::endl;
+  m_g13->stats().dump(o);
+  dump(o);
+  G13_OUT(o.str());
+
+  if (--active == 0) {
+    G13_Manager::Stop();
+  }
+}
+
+void G13_ReplayTransport::dump(std::ostream &o) const {
+  o << "   captured lcd_frames=" << m_lcd_frames
+    << " set_reports=" << m_set_report_count << std::endl;
+  for (auto &report : m_reports_set) {
+    o << "   report 0x" << std::hex << report.first << ":";
+    for (auto byte : report.second) {
+      o << " " << (int)byte;
+    }
+    o << std::dec << std::endl;
+  }
+}
+
+// *************************************************************************
+
+G13_Recorder::~G13_Recorder() { Stop(); }
+
+bool G13_Recorder::Start(const std::string &filename) {
+  Stop();
+  // the name may come from anyone able to write to the pipe or the control
+  // socket, never write over an existing file or through a link
+  int fd = open(filename.c_str(),
+                O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    G13_ERR("Cannot create capture file " << filename << ": "
+                                          << strerror(errno));
+    return false;
+  }
+
+  G13_CaptureHeader header{};
+  memcpy(header.magic, G13_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = G13_CAPTURE_VERSION;
+  header.record_size = sizeof(G13_ReplayReport);
+  timespec now{};
+  clock_gettime(CLOCK_REALTIME, &now);
+  header.start_time = now.tv_sec * 1000000000ull + now.tv_nsec;
+  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+    G13_ERR("Cannot write capture file " << filename << ": "
+                                         << strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  m_fd = fd;
+  m_filename = filename;
+  m_start = G13_Stats::Now();
+  m_count = 0;
+  m_buffered = 0;
+  // a quiet keypad should not keep its last reports from the file for long
+  m_timer = G13_Manager::AddTimer(1000, [this]() { Flush(); });
+  G13_OUT("Recording key reports to " << filename);
+  return true;
+}
+
+void G13_Recorder::Stop() {
+  if (m_fd < 0)
+    return;
+  if (m_timer >= 0) {
+    G13_Manager::RemoveTimer(m_timer);
+    m_timer = -1;
+  }
+  Flush();
+  close(m_fd);
+  m_fd = -1;
+  G13_OUT("Recorded " << m_count << " key reports to " << m_filename);
+}
+
+void G13_Recorder::Record(uint64_t time, const unsigned char *data) {
+  auto &record = m_buffer[m_buffered++];
+  record.time = time - m_start;
+  memcpy(record.data, data, G13_REPORT_SIZE);
+  m_count++;
+  if (m_buffered == G13_CAPTURE_BUFFER) {
+    Flush();
+  }
+}
+
+void G13_Recorder::Flush() {
+  if (!m_buffered)
+    return;
+  size_t size = m_buffered * sizeof(G13_ReplayReport);
+  if (write(m_fd, m_buffer, size) != (ssize_t)size) {
+    G13_ERR("Cannot write capture file " << m_filename << ": "
+                                         << strerror(errno));
+  }
+  m_buffered = 0;
+}
+
+// *************************************************************************
+
+bool G13_Manager::OpenReplayDevice(const std::string &filename) {
+  auto reports = G13_ReplayTransport::LoadReports(filename);
+  if (reports.empty()) {
+    G13_ERR("No reports to replay in " << filename);
+    return false;
+  }
+  bool realtime = getStringConfigValue("replay_speed") != "max";
+  auto transport =
+      std::make_unique<G13_ReplayTransport>(std::move(reports), realtime);
+  auto g13 = new G13_Device(std::move(transport), g13s.size());
+  g13s.push_back(g13);
+  pendingSetup.push_back(g13);
+  return true;
+}
+
+} // namespace G13
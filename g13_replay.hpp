@@ -0,0 +1,125 @@
+//
+// Transport replaying recorded key reports, for testing and benchmarking
+// without a keypad
+//
+
+#ifndef G13_G13_REPLAY_HPP
+#define G13_G13_REPLAY_HPP
+
+#include "g13.hpp"
+#include "g13_lcd.hpp"
+#include "g13_transport.hpp"
+#include <map>
+#include <ostream>
+
+namespace G13 {
+
+struct G13_ReplayReport {
+  uint64_t time; // nanoseconds since the first report
+  unsigned char data[G13_REPORT_SIZE];
+};
+
+/*
+ * Capture files written by the record command are a G13_CaptureHeader
+ * followed by packed G13_ReplayReport records, in host byte order, so they
+ * can be mapped and used in place. Record times are CLOCK_MONOTONIC
+ * nanoseconds since recording started.
+ */
+const char G13_CAPTURE_MAGIC[8] = {'G', '1', '3', 'C', 'A', 'P', 'T', 0};
+const uint32_t G13_CAPTURE_VERSION = 1;
+
+struct G13_CaptureHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size; // sizeof(G13_ReplayReport)
+  uint64_t start_time;  // wall clock ns when recording started
+  uint64_t reserved;
+};
+
+static_assert(sizeof(G13_CaptureHeader) == 32, "capture header layout");
+static_assert(sizeof(G13_ReplayReport) == 16, "capture record layout");
+
+// records kept in memory between writes to the capture file
+const size_t G13_CAPTURE_BUFFER = 256;
+
+/*!
+ * appends the reports received by a device to a capture file
+ */
+class G13_Recorder {
+public:
+  G13_Recorder() = default;
+  ~G13_Recorder();
+
+  bool Start(const std::string &filename);
+  void Stop();
+
+  // time is the G13_Stats::Now() the report arrived at
+  void Record(uint64_t time, const unsigned char *data);
+
+protected:
+  void Flush();
+
+  int m_fd = -1;
+  int m_timer = -1;
+  std::string m_filename;
+  uint64_t m_start = 0;
+  size_t m_count = 0;
+  G13_ReplayReport m_buffer[G13_CAPTURE_BUFFER]{};
+  size_t m_buffered = 0;
+};
+
+/*!
+ * feeds key reports from memory through the event loop, either spaced as
+ * recorded or as fast as they can be handled, and captures everything
+ * sent back to the keypad
+ */
+class G13_ReplayTransport : public G13_Transport {
+public:
+  G13_ReplayTransport(std::vector<G13_ReplayReport> reports, bool realtime);
+  ~G13_ReplayTransport() override;
+
+  // reads a capture file, or a file of raw G13_REPORT_SIZE reports
+  static std::vector<G13_ReplayReport> LoadReports(const std::string &filename);
+
+  int InitLcd() override { return LIBUSB_SUCCESS; }
+  int WriteLcd(const unsigned char *data) override;
+  int SetReport(uint16_t value, unsigned char *data, uint16_t size) override;
+  void StartKeyReader() override;
+  void StopKeyReader() override;
+  // everything sent back is captured at once, nothing to wait for
+  void Stop() override { StopKeyReader(); }
+
+  [[nodiscard]] libusb_device *Device() const override { return nullptr; }
+
+  [[nodiscard]] size_t lcd_frames() const { return m_lcd_frames; }
+  [[nodiscard]] const unsigned char *lcd_frame() const { return m_lcd_frame; }
+  [[nodiscard]] const std::map<uint16_t, std::vector<unsigned char>> &
+  reports_set() const {
+    return m_reports_set;
+  }
+
+  void dump(std::ostream &o) const;
+
+protected:
+  void Feed();
+  void Arm(uint64_t delay);
+  void Finished();
+
+  std::vector<G13_ReplayReport> m_reports;
+  size_t m_next;
+  bool m_realtime;
+  int m_timer;
+  uint64_t m_start;
+
+  size_t m_lcd_frames;
+  unsigned char m_lcd_frame[G13_LCD_BUFFER_SIZE]{};
+  std::map<uint16_t, std::vector<unsigned char>> m_reports_set;
+  size_t m_set_report_count;
+
+  // replays still running, the daemon stops once all are done
+  static int active;
+};
+
+} // namespace G13
+
+#endif // G13_G13_REPLAY_HPP
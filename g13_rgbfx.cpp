@@ -0,0 +1,148 @@
+//
+// Backlight effects: breathing, fades, blinking and per profile colours,
+// stepped by a timer of the daemon instead of scripts writing rgb commands
+//
+
+#include "g13_rgbfx.hpp"
+#include "g13_device.hpp"
+#include "g13_manager.hpp"
+#include "g13_stats.hpp"
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+
+namespace G13 {
+
+static G13_Color Scale(G13_Color color, double factor) {
+  return {(int)std::lround(color.red * factor),
+          (int)std::lround(color.green * factor),
+          (int)std::lround(color.blue * factor)};
+}
+
+static G13_Color Mix(G13_Color from, G13_Color to, double share) {
+  return {(int)std::lround(from.red + (to.red - from.red) * share),
+          (int)std::lround(from.green + (to.green - from.green) * share),
+          (int)std::lround(from.blue + (to.blue - from.blue) * share)};
+}
+
+static std::ostream &operator<<(std::ostream &o, const G13_Color &color) {
+  return o << color.red << " " << color.green << " " << color.blue;
+}
+
+void G13_RgbEffects::Breathe(G13_Color color, unsigned period_ms) {
+  Start(BREATHE, color, period_ms);
+}
+
+void G13_RgbEffects::Fade(G13_Color color, unsigned duration_ms) {
+  Start(FADE, color, duration_ms);
+}
+
+void G13_RgbEffects::Blink(G13_Color color, unsigned on_ms, unsigned off_ms) {
+  Start(BLINK, color, on_ms, off_ms);
+}
+
+void G13_RgbEffects::Stop() {
+  m_effect = NONE;
+  StopTimer();
+}
+
+void G13_RgbEffects::SetRate(unsigned steps_per_second) {
+  m_rate = steps_per_second;
+  if (m_timer >= 0) {
+    StopTimer();
+    StartTimer();
+  }
+}
+
+void G13_RgbEffects::SetProfileColor(const std::string &profile,
+                                     G13_Color color, unsigned duration_ms) {
+  m_profile_colors[profile] = {color, duration_ms};
+}
+
+void G13_RgbEffects::ClearProfileColor(const std::string &profile) {
+  m_profile_colors.erase(profile);
+}
+
+void G13_RgbEffects::ProfileChanged(const std::string &profile) {
+  auto profile_color = m_profile_colors.find(profile);
+  if (profile_color != m_profile_colors.end()) {
+    Fade(profile_color->second.color, profile_color->second.duration_ms);
+  }
+}
+
+void G13_RgbEffects::Start(Effect effect, G13_Color color, unsigned period_ms,
+                           unsigned off_ms) {
+  m_effect = effect;
+  m_from = m_keypad.key_color();
+  m_to = color;
+  m_period_ms = period_ms;
+  m_off_ms = off_ms;
+  m_start = G13_Stats::Now();
+  Step();
+  if (m_effect != NONE) {
+    StartTimer();
+  }
+}
+
+void G13_RgbEffects::Step() {
+  double elapsed_ms = (double)(G13_Stats::Now() - m_start) / 1000000;
+  G13_Color color{};
+
+  switch (m_effect) {
+  case NONE:
+    return;
+  case BREATHE: {
+    double phase = std::fmod(elapsed_ms, m_period_ms) / m_period_ms;
+    color = Scale(m_to, (1 - std::cos(2 * M_PI * phase)) / 2);
+    break;
+  }
+  case FADE:
+    if (elapsed_ms >= m_period_ms) {
+      color = m_to;
+      Stop();
+    } else {
+      color = Mix(m_from, m_to, elapsed_ms / m_period_ms);
+    }
+    break;
+  case BLINK:
+    color = std::fmod(elapsed_ms, m_period_ms + m_off_ms) < m_period_ms
+                ? m_to
+                : G13_Color{0, 0, 0};
+    break;
+  }
+
+  // most steps of a slow effect round to the colour already shown
+  if (color != m_keypad.key_color()) {
+    m_keypad.SetKeyColor(color.red, color.green, color.blue);
+  }
+}
+
+void G13_RgbEffects::StartTimer() {
+  if (m_timer >= 0 || !m_rate)
+    return;
+  m_timer = G13_Manager::AddTimer(std::max(1u, 1000 / m_rate),
+                                  [this]() { Step(); });
+}
+
+void G13_RgbEffects::StopTimer() {
+  G13_Manager::RemoveTimer(m_timer);
+  m_timer = -1;
+}
+
+void G13_RgbEffects::dump(std::ostream &o) const {
+  static const char *names[] = {"none", "breathe", "fade", "blink"};
+  o << "   effect " << names[m_effect];
+  if (m_effect != NONE) {
+    o << " " << m_to << " " << m_period_ms;
+    if (m_effect == BLINK)
+      o << " " << m_off_ms;
+  }
+  o << " at " << m_rate << " steps/s" << std::endl;
+  for (auto &profile_color : m_profile_colors) {
+    o << "   profile " << std::setw(12) << profile_color.first << " "
+      << profile_color.second.color << " "
+      << profile_color.second.duration_ms << std::endl;
+  }
+}
+
+} // namespace G13
@@ -0,0 +1,102 @@
+//
+// Backlight effects: breathing, fades, blinking and per profile colours,
+// stepped by a timer of the daemon instead of scripts writing rgb commands
+//
+
+#ifndef G13_G13_RGBFX_HPP
+#define G13_G13_RGBFX_HPP
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+namespace G13 {
+class G13_Device;
+
+// effect steps per second unless changed with "rgbfx rate"
+const unsigned G13_RGBFX_DEFAULT_RATE = 30;
+
+// longest period or duration of an effect, an hour
+const unsigned G13_RGBFX_MAX_MS = 3600000;
+
+struct G13_Color {
+  int red;
+  int green;
+  int blue;
+
+  bool operator==(const G13_Color &other) const {
+    return red == other.red && green == other.green && blue == other.blue;
+  }
+  bool operator!=(const G13_Color &other) const { return !(*this == other); }
+};
+
+/*!
+ * runs one backlight effect at a time
+ *
+ * Every step computes the colour of the effect at that time, and only sends
+ * it when it differs from the colour the keypad already shows. The timer
+ * runs while an effect does.
+ */
+class G13_RgbEffects {
+public:
+  explicit G13_RgbEffects(G13_Device &keypad) : m_keypad(keypad) {}
+  G13_RgbEffects(const G13_RgbEffects &) = delete;
+
+  // brightness of color rising and falling, once per period
+  void Breathe(G13_Color color, unsigned period_ms);
+
+  // from the current colour to color, then stays there
+  void Fade(G13_Color color, unsigned duration_ms);
+
+  // color for on_ms, dark for off_ms
+  void Blink(G13_Color color, unsigned on_ms, unsigned off_ms);
+
+  // ends the effect, leaving the colour as it is
+  void Stop();
+
+  void SetRate(unsigned steps_per_second);
+
+  // fades to color over duration_ms whenever profile becomes current
+  void SetProfileColor(const std::string &profile, G13_Color color,
+                       unsigned duration_ms);
+  void ClearProfileColor(const std::string &profile);
+
+  // called by the device after switching profiles
+  void ProfileChanged(const std::string &profile);
+
+  void dump(std::ostream &o) const;
+
+protected:
+  enum Effect { NONE, BREATHE, FADE, BLINK };
+
+  struct ProfileColor {
+    G13_Color color;
+    unsigned duration_ms;
+  };
+
+  void Start(Effect effect, G13_Color color, unsigned period_ms,
+             unsigned off_ms = 0);
+
+  void Step();
+
+  void StartTimer();
+  void StopTimer();
+
+  G13_Device &m_keypad;
+  unsigned m_rate = G13_RGBFX_DEFAULT_RATE;
+  int m_timer = -1;
+
+  Effect m_effect = NONE;
+  G13_Color m_from{}; // colour when a fade started
+  G13_Color m_to{};
+  unsigned m_period_ms{}; // breathing period, fade duration or blink on time
+  unsigned m_off_ms{};
+  uint64_t m_start{}; // G13_Stats::Now() when the effect started
+
+  std::map<std::string, ProfileColor> m_profile_colors;
+};
+
+} // namespace G13
+
+#endif // G13_G13_RGBFX_HPP
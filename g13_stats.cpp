@@ -0,0 +1,139 @@
+//
+// Latency histograms and counters for the input path
+//
+
+#include "g13_stats.hpp"
+#include <iomanip>
+
+namespace G13 {
+
+unsigned G13_Histogram::bucket_index(uint64_t value) {
+  if (value < LINEAR_BUCKETS)
+    return (unsigned)value;
+  unsigned exponent = 63 - __builtin_clzll(value);
+  // top 4 bits of the value, the leading one is implicit
+  unsigned mantissa = (unsigned)(value >> (exponent - 3)) - SUB_BUCKETS;
+  return LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + mantissa;
+}
+
+uint64_t G13_Histogram::bucket_upper(unsigned index) {
+  if (index < LINEAR_BUCKETS)
+    return index;
+  unsigned exponent = (index - LINEAR_BUCKETS) / SUB_BUCKETS + 4;
+  uint64_t mantissa = (index - LINEAR_BUCKETS) % SUB_BUCKETS + SUB_BUCKETS;
+  return ((mantissa + 1) << (exponent - 3)) - 1;
+}
+
+void G13_Histogram::record(uint64_t value) {
+  m_buckets[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+  m_count.fetch_add(1, std::memory_order_relaxed);
+  m_sum.fetch_add(value, std::memory_order_relaxed);
+
+  auto min = m_min.load(std::memory_order_relaxed);
+  while (value < min &&
+         !m_min.compare_exchange_weak(min, value, std::memory_order_relaxed))
+    ;
+  auto max = m_max.load(std::memory_order_relaxed);
+  while (value > max &&
+         !m_max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+    ;
+}
+
+void G13_Histogram::reset() {
+  for (auto &bucket : m_buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  m_count.store(0, std::memory_order_relaxed);
+  m_sum.store(0, std::memory_order_relaxed);
+  m_min.store(UINT64_MAX, std::memory_order_relaxed);
+  m_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t G13_Histogram::percentile(double p) const {
+  uint64_t total = count();
+  if (!total)
+    return 0;
+  auto wanted = (uint64_t)(p / 100.0 * (double)total + 0.5);
+  if (wanted < 1)
+    wanted = 1;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < BUCKETS; i++) {
+    seen += m_buckets[i].load(std::memory_order_relaxed);
+    if (seen >= wanted) {
+      return std::min(bucket_upper(i), m_max.load(std::memory_order_relaxed));
+    }
+  }
+  return m_max.load(std::memory_order_relaxed);
+}
+
+void G13_Histogram::dump(std::ostream &o, const char *name) const {
+  auto us = [](uint64_t ns) { return (double)ns / 1000.0; };
+  uint64_t total = count();
+
+  o << "   " << std::left << std::setw(14) << name << std::right
+    << " count=" << total;
+  if (total) {
+    o << std::fixed << std::setprecision(1)
+      << " min=" << us(m_min.load(std::memory_order_relaxed))
+      << " avg=" << us(m_sum.load(std::memory_order_relaxed) / total)
+      << " p50=" << us(percentile(50)) << " p90=" << us(percentile(90))
+      << " p99=" << us(percentile(99)) << " p99.9=" << us(percentile(99.9))
+      << " max=" << us(m_max.load(std::memory_order_relaxed)) << " us";
+    o.unsetf(std::ios::floatfield);
+  }
+  o << std::endl;
+}
+
+void G13_Stats::reset() {
+  for (auto histogram : {&latency, &report, &parse_keys, &action,
+                         &uinput_write}) {
+    histogram->reset();
+  }
+  for (auto counter : {&reports, &usb_timeouts, &usb_errors, &events,
+                       &uinput_writes, &lcd_frames, &lcd_unchanged,
+                       &lcd_transfers, &lcd_replaced, &control_transfers,
+                       &control_replaced}) {
+    counter->store(0, std::memory_order_relaxed);
+  }
+  for (auto &counter : actions) {
+    counter.store(0, std::memory_order_relaxed);
+  }
+  m_since = Now();
+}
+
+void G13_Stats::dump(std::ostream &o) const {
+  auto load = [](const std::atomic<uint64_t> &counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  double elapsed = (double)(Now() - m_since) / 1e9;
+
+  o << std::fixed << std::setprecision(1) << "   elapsed=" << elapsed
+    << " s reports=" << load(reports) << " ("
+    << (elapsed > 0 ? (double)load(reports) / elapsed : 0.0) << "/s)"
+    << std::endl;
+  o.unsetf(std::ios::floatfield);
+  o << "   usb_timeouts=" << load(usb_timeouts)
+    << " usb_errors=" << load(usb_errors) << " events=" << load(events)
+    << " uinput_writes=" << load(uinput_writes) << std::endl;
+  o << "   actions keys=" << load(actions[ACTION_KEYS])
+    << " pipeout=" << load(actions[ACTION_PIPEOUT])
+    << " command=" << load(actions[ACTION_COMMAND]) << std::endl;
+  o << "   lcd frames=" << load(lcd_frames)
+    << " unchanged=" << load(lcd_unchanged)
+    << " replaced=" << load(lcd_replaced)
+    << " transferred=" << load(lcd_transfers) << std::fixed
+    << std::setprecision(1) << " ("
+    << (elapsed > 0 ? (double)load(lcd_transfers) / elapsed : 0.0)
+    << " fps)" << std::endl;
+  o.unsetf(std::ios::floatfield);
+  o << "   control transferred=" << load(control_transfers)
+    << " replaced=" << load(control_replaced) << std::endl;
+
+  latency.dump(o, "callback->uinput");
+  report.dump(o, "report");
+  parse_keys.dump(o, "parse_keys");
+  action.dump(o, "action");
+  uinput_write.dump(o, "uinput_write");
+}
+
+} // namespace G13
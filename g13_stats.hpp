@@ -0,0 +1,106 @@
+//
+// Latency histograms and counters for the input path
+//
+
+#ifndef G13_G13_STATS_HPP
+#define G13_G13_STATS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <time.h>
+
+namespace G13 {
+
+enum G13_ActionKind { ACTION_KEYS, ACTION_PIPEOUT, ACTION_COMMAND, ACTION_KINDS };
+
+/*!
+ * HDR style histogram of nanosecond values
+ *
+ * Values below 16 get a bucket of their own, larger values are split into
+ * 8 sub-buckets per power of two, which keeps the relative error of any
+ * reported value below 12.5%. Updates are lock-free.
+ */
+class G13_Histogram {
+public:
+  void record(uint64_t value);
+  void reset();
+
+  [[nodiscard]] uint64_t count() const {
+    return m_count.load(std::memory_order_relaxed);
+  }
+  [[nodiscard]] uint64_t percentile(double p) const;
+
+  void dump(std::ostream &o, const char *name) const;
+
+  static unsigned bucket_index(uint64_t value);
+  static uint64_t bucket_upper(unsigned index);
+
+private:
+  static const unsigned LINEAR_BUCKETS = 16;
+  static const unsigned SUB_BUCKETS = 8;
+  static const unsigned BUCKETS = LINEAR_BUCKETS + (64 - 4) * SUB_BUCKETS;
+
+  std::atomic<uint64_t> m_buckets[BUCKETS]{};
+  std::atomic<uint64_t> m_count{};
+  std::atomic<uint64_t> m_sum{};
+  std::atomic<uint64_t> m_min{UINT64_MAX};
+  std::atomic<uint64_t> m_max{};
+};
+
+/*!
+ * per device instrumentation of the report -> uinput path
+ */
+class G13_Stats {
+public:
+  G13_Stats() { reset(); }
+
+  static uint64_t Now() {
+    struct timespec ts {};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+  }
+
+  static void count(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void reset();
+  void dump(std::ostream &o) const;
+
+  // report callback start to finished uinput write, leaving out the time
+  // the completed transfer waited for the event loop
+  G13_Histogram latency;
+  // whole report handling, including reports producing no events
+  G13_Histogram report;
+  // key dispatch, only for reports changing the key state
+  G13_Histogram parse_keys;
+  G13_Histogram action;
+  G13_Histogram uinput_write;
+
+  std::atomic<uint64_t> reports{};
+  // LCD and report transfers, key reads never time out
+  std::atomic<uint64_t> usb_timeouts{};
+  std::atomic<uint64_t> usb_errors{};
+  std::atomic<uint64_t> events{};
+  std::atomic<uint64_t> uinput_writes{};
+  std::atomic<uint64_t> actions[ACTION_KINDS]{};
+  // LCD frames sent, and frames not sent being the same as the last one
+  std::atomic<uint64_t> lcd_frames{};
+  std::atomic<uint64_t> lcd_unchanged{};
+  // frames the keypad received, and frames replaced by a newer one while
+  // waiting for the one in flight
+  std::atomic<uint64_t> lcd_transfers{};
+  std::atomic<uint64_t> lcd_replaced{};
+  // SET_REPORT requests sent, and replaced while waiting for the previous
+  // request of the same report
+  std::atomic<uint64_t> control_transfers{};
+  std::atomic<uint64_t> control_replaced{};
+
+private:
+  uint64_t m_since{};
+};
+
+} // namespace G13
+
+#endif // G13_G13_STATS_HPP
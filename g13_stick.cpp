@@ -7,7 +7,7 @@ namespace G13 {
 
 // *************************************************************************
 
-void G13_Device::parse_joystick(unsigned char *buf) {
+void G13_Device::parse_joystick(const unsigned char *buf) {
   m_stick.ParseJoystick(buf);
 }
 
@@ -40,6 +40,7 @@ G13_StickZone *G13_Stick::zone(const std::string &name, bool create) {
   if (create) {
     m_zones.push_back(
         G13_StickZone(*this, name, G13_ZoneBounds(0.0, 0.0, 0.0, 0.0)));
+    ZonesChanged();
     return zone(name);
   }
   return nullptr;
@@ -58,6 +59,7 @@ G13_Stick::FilteredZoneNames(const std::regex &pattern) {
 void G13_Stick::set_mode(stick_mode_t m) {
   if (m == m_stick_mode)
     return;
+  ZonesChanged();
   if (m_stick_mode == STICK_CALCENTER || m_stick_mode == STICK_CALBOUNDS ||
       m_stick_mode == STICK_CALNORTH) {
     RecalcCalibrated();
@@ -84,8 +86,82 @@ void G13_Stick::RecalcCalibrated() {}
 void G13_Stick::RemoveZone(const G13_StickZone &zone) {
   const G13_StickZone &target(zone);
   m_zones.erase(std::remove(m_zones.begin(), m_zones.end(), target), m_zones.end());
+  ZonesChanged();
+}
+
+double G13_Stick::Normalize(int pos, int low, int center, int high) {
+  double d;
+  if (pos <= center) {
+    d = pos - low;
+    d /= (center - low) * 2;
+  } else {
+    d = high - pos;
+    d /= (high - center) * 2;
+    d = 1.0 - d;
+  }
+  return d;
+}
+
+void G13_Stick::set_deadzone(double radius) {
+  m_deadzone = radius;
+  ZonesChanged();
+}
+
+G13_ZoneCoord G13_Stick::Position() const {
+  return G13_ZoneCoord(Normalize(m_current_pos.x, m_bounds.tl.x,
+                                 m_center_pos.x, m_bounds.br.x),
+                       Normalize(m_current_pos.y, m_bounds.tl.y,
+                                 m_center_pos.y, m_bounds.br.y));
+}
+
+void G13_Stick::BuildZoneTables() {
+  size_t count = std::min(m_zones.size(), G13_STICK_TABLE_ZONES);
+  std::vector<G13_ZoneBounds> enter, stay;
+  for (size_t i = 0; i < count; i++) {
+    enter.push_back(m_zones[i].enter_bounds());
+    stay.push_back(m_zones[i].stay_bounds());
+  }
+
+  m_zone_mask = 0;
+  m_zone_repeat = 0;
+  for (int pos = 0; pos < 256; pos++) {
+    double dx = Normalize(pos, m_bounds.tl.x, m_center_pos.x, m_bounds.br.x);
+    double dy = Normalize(pos, m_bounds.tl.y, m_center_pos.y, m_bounds.br.y);
+    m_center_dx2[pos] = (dx - 0.5) * (dx - 0.5);
+    m_center_dy2[pos] = (dy - 0.5) * (dy - 0.5);
+    uint64_t x_mask = 0, y_mask = 0, stay_x_mask = 0, stay_y_mask = 0;
+    for (size_t i = 0; i < count; i++) {
+      // zones without an action are left alone, as by G13_StickZone::test()
+      if (!m_zones[i].action())
+        continue;
+      uint64_t bit = uint64_t(1) << i;
+      if (enter[i].tl.x <= dx && dx <= enter[i].br.x)
+        x_mask |= bit;
+      if (enter[i].tl.y <= dy && dy <= enter[i].br.y)
+        y_mask |= bit;
+      if (stay[i].tl.x <= dx && dx <= stay[i].br.x)
+        stay_x_mask |= bit;
+      if (stay[i].tl.y <= dy && dy <= stay[i].br.y)
+        stay_y_mask |= bit;
+    }
+    m_zone_x[pos] = x_mask;
+    m_zone_y[pos] = y_mask;
+    m_zone_stay_x[pos] = stay_x_mask;
+    m_zone_stay_y[pos] = stay_y_mask;
+  }
+  // zones may have moved to other bits
+  for (size_t i = 0; i < count; i++) {
+    if (m_zones[i].action() && m_zones[i].active())
+      m_zone_mask |= uint64_t(1) << i;
+    if (m_zones[i].repeat())
+      m_zone_repeat |= uint64_t(1) << i;
+  }
+  m_zone_tables_valid = true;
 }
 void G13_Stick::dump(std::ostream &out) const {
+  if (m_deadzone > 0) {
+    out << "   deadzone " << m_deadzone << std::endl;
+  }
   for (auto &zone : m_zones) {
     zone.dump(out);
     out << std::endl;
@@ -94,6 +170,12 @@ void G13_Stick::dump(std::ostream &out) const {
 
 void G13_StickZone::dump(std::ostream &out) const {
   out << "   " << std::setw(20) << name() << "   " << _bounds << "  ";
+  if (_repeat) {
+    out << "repeat ";
+  }
+  if (_enter_margin > 0 || _exit_margin > 0) {
+    out << "hysteresis " << _enter_margin << " " << _exit_margin << " ";
+  }
   if (action()) {
     action()->dump(out);
   } else {
@@ -104,14 +186,56 @@ void G13_StickZone::dump(std::ostream &out) const {
 void G13_StickZone::test(const G13_ZoneCoord &loc) {
   if (!_action)
     return;
+  update(_active ? stay_bounds().contains(loc) : enter_bounds().contains(loc));
+}
+
+// bounds moved in by margin, except for edges at the limits of the range
+static G13_ZoneBounds ShrinkBounds(G13_ZoneBounds bounds, double margin) {
+  if (bounds.tl.x > 0.0)
+    bounds.tl.x += margin;
+  if (bounds.tl.y > 0.0)
+    bounds.tl.y += margin;
+  if (bounds.br.x < 1.0)
+    bounds.br.x -= margin;
+  if (bounds.br.y < 1.0)
+    bounds.br.y -= margin;
+  return bounds;
+}
+
+static bool Enterable(const G13_ZoneBounds &bounds, double enter_margin) {
+  auto enter = ShrinkBounds(bounds, enter_margin);
+  return enter.tl.x <= enter.br.x && enter.tl.y <= enter.br.y;
+}
+
+bool G13_StickZone::set_hysteresis(double enter_margin, double exit_margin) {
+  if (!Enterable(_bounds, enter_margin))
+    return false;
+  _enter_margin = enter_margin;
+  _exit_margin = exit_margin;
+  parent().ZonesChanged();
+  return true;
+}
+
+G13_ZoneBounds G13_StickZone::enter_bounds() const {
+  return ShrinkBounds(_bounds, _enter_margin);
+}
+
+G13_ZoneBounds G13_StickZone::stay_bounds() const {
+  return G13_ZoneBounds(_bounds.tl.x - _exit_margin,
+                        _bounds.tl.y - _exit_margin,
+                        _bounds.br.x + _exit_margin,
+                        _bounds.br.y + _exit_margin);
+}
+
+void G13_StickZone::update(bool active) {
   bool prior_active = _active;
-  _active = _bounds.contains(loc);
+  _active = active;
   if (!_active) {
     if (prior_active) {
       // cout << "exit stick zone " << m_name << std::endl;
       _action->act(false);
     }
-  } else {
+  } else if (!prior_active || _repeat) {
     // cout << "in stick zone " << m_name << std::endl;
     _action->act(true);
   }
@@ -124,6 +248,24 @@ G13_StickZone::G13_StickZone(G13_Stick &stick, const std::string &name,
   set_action(action); // Call to virtual from ctor!
 }
 
+bool G13_StickZone::set_bounds(const G13_ZoneBounds &bounds) {
+  if (!Enterable(bounds, _enter_margin))
+    return false;
+  _bounds = bounds;
+  parent().ZonesChanged();
+  return true;
+}
+
+void G13_StickZone::set_repeat(bool repeat) {
+  _repeat = repeat;
+  parent().ZonesChanged();
+}
+
+void G13_StickZone::set_action(const G13_ActionPtr &action) {
+  G13_Actionable<G13_Stick>::set_action(action);
+  parent().ZonesChanged();
+}
+
 void G13_Stick::ParseJoystick(const unsigned char *buf) {
   m_current_pos.x = buf[1];
   m_current_pos.y = buf[2];
@@ -132,6 +274,7 @@ void G13_Stick::ParseJoystick(const unsigned char *buf) {
   switch (m_stick_mode) {
   case STICK_CALCENTER:
     m_center_pos = m_current_pos;
+    ZonesChanged();
     return;
 
   case STICK_CALNORTH:
@@ -140,6 +283,7 @@ void G13_Stick::ParseJoystick(const unsigned char *buf) {
 
   case STICK_CALBOUNDS:
     m_bounds.expand(m_current_pos);
+    ZonesChanged();
     return;
 
   case STICK_ABSOLUTE:
@@ -148,37 +292,48 @@ void G13_Stick::ParseJoystick(const unsigned char *buf) {
     break;
   }
 
-  // determine our normalized position
-  double dx; // = 0.5
-  if (m_current_pos.x <= m_center_pos.x) {
-    dx = m_current_pos.x - m_bounds.tl.x;
-    dx /= (m_center_pos.x - m_bounds.tl.x) * 2;
-  } else {
-    dx = m_bounds.br.x - m_current_pos.x;
-    dx /= (m_bounds.br.x - m_center_pos.x) * 2;
-    dx = 1.0 - dx;
-  }
-  double dy; // = 0.5;
-  if (m_current_pos.y <= m_center_pos.y) {
-    dy = m_current_pos.y - m_bounds.tl.y;
-    dy /= (m_center_pos.y - m_bounds.tl.y) * 2;
-  } else {
-    dy = m_bounds.br.y - m_current_pos.y;
-    dy /= (m_bounds.br.y - m_center_pos.y) * 2;
-    dy = 1.0 - dy;
-  }
-
-  G13_DBG("x=" << m_current_pos.x << " y=" << m_current_pos.y << " dx=" << dx
-               << " dy=" << dy);
-  G13_ZoneCoord jpos(dx, dy);
   if (m_stick_mode == STICK_ABSOLUTE) {
     _keypad.SendEvent(EV_ABS, ABS_X, m_current_pos.x);
     _keypad.SendEvent(EV_ABS, ABS_Y, m_current_pos.y);
 
   } else if (m_stick_mode == STICK_KEYS) {
-    // BOOST_FOREACH (G13_StickZone& zone, m_zones) { zone.test(jpos); }
-    for (auto &zone : m_zones) {
-      zone.test(jpos);
+    if (!m_zone_tables_valid) {
+      BuildZoneTables();
+    }
+    int x = m_current_pos.x;
+    int y = m_current_pos.y;
+    uint64_t mask = 0;
+    bool centered =
+        m_center_dx2[x] + m_center_dy2[y] < m_deadzone * m_deadzone;
+    if (!centered) {
+      mask = (m_zone_x[x] & m_zone_y[y]) |
+             (m_zone_mask & m_zone_stay_x[x] & m_zone_stay_y[y]);
+    }
+    G13_DBG("x=" << m_current_pos.x << " y=" << m_current_pos.y
+                 << " zones=" << std::hex << mask << std::dec);
+
+    // zones act when the stick enters or leaves them, repeating zones also
+    // while it stays in them
+    uint64_t acting = (mask ^ m_zone_mask) | (mask & m_zone_repeat);
+    m_zone_mask = mask;
+    while (acting) {
+      int i = __builtin_ctzll(acting);
+      acting &= acting - 1;
+      m_zones[i].update(mask >> i & 1);
+      // an action changing the zones, the rest waits for the next report
+      if (!m_zone_tables_valid)
+        break;
+    }
+
+    if (m_zones.size() > G13_STICK_TABLE_ZONES) {
+      G13_ZoneCoord jpos = Position();
+      for (size_t i = G13_STICK_TABLE_ZONES; i < m_zones.size(); i++) {
+        if (centered && m_zones[i].action()) {
+          m_zones[i].update(false);
+        } else {
+          m_zones[i].test(jpos);
+        }
+      }
     }
     return;
 
@@ -5,6 +5,7 @@
 #ifndef G13_G13_STICK_HPP
 #define G13_G13_STICK_HPP
 
+#include <cstdint>
 #include <vector>
 #include <regex>
 #include "helper.hpp"
@@ -21,6 +22,9 @@ typedef Helper::Bounds<double> G13_ZoneBounds;
 
 class G13_StickZone;
 
+// zones looked up in the position tables, any further ones are tested
+const size_t G13_STICK_TABLE_ZONES = 64;
+
 enum stick_mode_t {
   STICK_ABSOLUTE,
   STICK_KEYS,
@@ -40,6 +44,12 @@ public:
   std::vector<std::string> FilteredZoneNames(const std::regex &pattern);
   void RemoveZone(const G13_StickZone &zone);
 
+  // zones, their bounds or actions, or the calibration changed
+  void ZonesChanged() { m_zone_tables_valid = false; }
+
+  // no zone is active within radius of the center, in zone coordinates
+  void set_deadzone(double radius);
+
   /*
     [[nodiscard]] const std::vector<G13_StickZone> &zones() const {
       return m_zones;
@@ -51,6 +61,14 @@ public:
 protected:
   void RecalcCalibrated();
 
+  // position from 0.0 to 1.0 of a raw axis value, center being 0.5
+  static double Normalize(int pos, int low, int center, int high);
+
+  // normalized m_current_pos
+  [[nodiscard]] G13_ZoneCoord Position() const;
+
+  void BuildZoneTables();
+
   G13_Device &_keypad;
   std::vector<G13_StickZone> m_zones;
 
@@ -61,6 +79,28 @@ protected:
   G13_StickCoord m_current_pos;
 
   stick_mode_t m_stick_mode;
+
+  /*
+   * Zones are rectangles and the normalized x only depends on the raw x,
+   * so the zones containing a raw position are m_zone_x[x] & m_zone_y[y],
+   * bit n standing for zone n. m_zone_mask holds the zones the stick was
+   * in at the last report, m_zone_repeat the zones acting on every report.
+   * Zones are entered by the m_zone_ tables and stayed in by the
+   * m_zone_stay_ tables, see G13_StickZone::set_hysteresis().
+   */
+  uint64_t m_zone_x[256]{};
+  uint64_t m_zone_y[256]{};
+  uint64_t m_zone_stay_x[256]{};
+  uint64_t m_zone_stay_y[256]{};
+  uint64_t m_zone_mask{};
+  uint64_t m_zone_repeat{};
+  bool m_zone_tables_valid = false;
+
+  // squared distance from the center along each axis, compared against the
+  // squared deadzone radius
+  double m_deadzone{};
+  double m_center_dx2[256]{};
+  double m_center_dy2[256]{};
 };
 
 } // namespace G13
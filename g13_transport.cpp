@@ -0,0 +1,413 @@
+//
+// USB transports used by G13_Device
+//
+
+#include "g13_transport.hpp"
+#include "g13.hpp"
+#include "g13_device.hpp"
+#include "g13_lcd.hpp"
+#include "g13_log.hpp"
+#include "g13_manager.hpp"
+
+namespace G13 {
+
+G13_Transport::~G13_Transport() = default;
+
+// *************************************************************************
+
+G13_LibusbTransport::G13_LibusbTransport(libusb_device *dev,
+                                         libusb_context *ctx,
+                                         libusb_device_handle *handle)
+    : m_ctx(ctx), m_handle(handle), m_device(dev), m_key_transfers_busy(0) {}
+
+G13_LibusbTransport::~G13_LibusbTransport() {
+  Stop();
+  if (m_handle) {
+    libusb_release_interface(m_handle, 0);
+    libusb_close(m_handle);
+  }
+}
+
+void G13_LibusbTransport::Stop() {
+  StopKeyReader();
+  StopLcd();
+  StopReports();
+}
+
+std::string G13_LibusbTransport::DescribeTransferStatus(int status) {
+  switch (status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return "Completed";
+  case LIBUSB_TRANSFER_ERROR:
+    return "Transfer failed";
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return "Transfer timed out";
+  case LIBUSB_TRANSFER_CANCELLED:
+    return "Transfer was cancelled";
+  case LIBUSB_TRANSFER_STALL:
+    return "Endpoint stalled";
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return "Device was disconnected";
+  case LIBUSB_TRANSFER_OVERFLOW:
+    return "Device sent more data than requested";
+  default:
+    return "Unknown transfer status " + std::to_string(status);
+  }
+}
+
+int G13_LibusbTransport::InitLcd() {
+  return libusb_control_transfer(m_handle, 0, 9, 1, 0, nullptr, 0, 1000);
+}
+
+int G13_LibusbTransport::WriteLcd(const unsigned char *data) {
+  if (m_lcd_busy) {
+    if (m_lcd_has_pending) {
+      G13_Stats::count(m_g13->stats().lcd_replaced);
+    }
+    memcpy(m_lcd_pending, data, G13_LCD_BUFFER_SIZE);
+    m_lcd_has_pending = true;
+    return LIBUSB_SUCCESS;
+  }
+
+  if (!m_lcd_transfer) {
+    m_lcd_buffer = libusb_dev_mem_alloc(m_handle, G13_LCD_TRANSFER_SIZE);
+    m_lcd_buffer_pinned = m_lcd_buffer != nullptr;
+    if (!m_lcd_buffer) {
+      m_lcd_buffer =
+          static_cast<unsigned char *>(malloc(G13_LCD_TRANSFER_SIZE));
+    }
+    m_lcd_transfer = libusb_alloc_transfer(0);
+    if (!m_lcd_buffer || !m_lcd_transfer) {
+      StopLcd();
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    // the header before the image stays the same for every frame
+    memset(m_lcd_buffer, 0, G13_LCD_TRANSFER_SIZE);
+    m_lcd_buffer[0] = 0x03;
+    libusb_fill_interrupt_transfer(
+        m_lcd_transfer, m_handle, LIBUSB_ENDPOINT_OUT | G13_LCD_ENDPOINT,
+        m_lcd_buffer, G13_LCD_TRANSFER_SIZE, LcdTransferCallback, this, 1000);
+  }
+  memcpy(m_lcd_buffer + G13_LCD_TRANSFER_SIZE - G13_LCD_BUFFER_SIZE, data,
+         G13_LCD_BUFFER_SIZE);
+  return SubmitLcdTransfer();
+}
+
+int G13_LibusbTransport::SubmitLcdTransfer() {
+  int error = libusb_submit_transfer(m_lcd_transfer);
+  if (error == LIBUSB_SUCCESS) {
+    m_lcd_busy = true;
+  }
+  return error;
+}
+
+void LIBUSB_CALL
+G13_LibusbTransport::LcdTransferCallback(libusb_transfer *transfer) {
+  auto self = static_cast<G13_LibusbTransport *>(transfer->user_data);
+  auto &stats = self->m_g13->stats();
+  self->m_lcd_busy = false;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    G13_Stats::count(stats.lcd_transfers);
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    G13_Stats::count(stats.usb_timeouts);
+    G13_ERR("Error when transferring image: "
+            << DescribeTransferStatus(transfer->status));
+    break;
+  default:
+    G13_Stats::count(stats.usb_errors);
+    G13_ERR("Error when transferring image: "
+            << DescribeTransferStatus(transfer->status));
+    break;
+  }
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    // the keypad still shows an older frame, do not skip this one later
+    self->m_g13->lcd().ForgetSent();
+  }
+
+  if (self->m_lcd_has_pending) {
+    self->m_lcd_has_pending = false;
+    memcpy(transfer->buffer + G13_LCD_TRANSFER_SIZE - G13_LCD_BUFFER_SIZE,
+           self->m_lcd_pending, G13_LCD_BUFFER_SIZE);
+    int error = self->SubmitLcdTransfer();
+    if (error != LIBUSB_SUCCESS) {
+      G13_ERR("Error when transferring image: "
+              << G13_Device::DescribeLibusbErrorCode(error));
+    }
+  }
+}
+
+void G13_LibusbTransport::StopLcd() {
+  if (m_lcd_busy && libusb_cancel_transfer(m_lcd_transfer) == LIBUSB_SUCCESS) {
+    while (m_lcd_busy) {
+      if (libusb_handle_events(m_ctx) != LIBUSB_SUCCESS)
+        break;
+    }
+  }
+  if (m_lcd_busy) {
+    G13_ERR("LCD transfer still pending, leaking");
+    return;
+  }
+  if (m_lcd_transfer) {
+    libusb_free_transfer(m_lcd_transfer);
+    m_lcd_transfer = nullptr;
+  }
+  if (m_lcd_buffer) {
+    if (m_lcd_buffer_pinned) {
+      libusb_dev_mem_free(m_handle, m_lcd_buffer, G13_LCD_TRANSFER_SIZE);
+    } else {
+      free(m_lcd_buffer);
+    }
+    m_lcd_buffer = nullptr;
+  }
+  m_lcd_has_pending = false;
+}
+
+int G13_LibusbTransport::SetReport(uint16_t value, unsigned char *data,
+                                   uint16_t size) {
+  if (size > G13_SET_REPORT_MAX) {
+    return LIBUSB_ERROR_INVALID_PARAM;
+  }
+  auto &queue =
+      m_reports.emplace(value, ReportQueue{this, value}).first->second;
+  if (queue.busy) {
+    if (queue.has_pending) {
+      G13_Stats::count(m_g13->stats().control_replaced);
+    }
+    memcpy(queue.pending, data, size);
+    queue.pending_size = size;
+    queue.has_pending = true;
+    return LIBUSB_SUCCESS;
+  }
+
+  if (!queue.transfer) {
+    queue.transfer = libusb_alloc_transfer(0);
+    auto buffer = static_cast<unsigned char *>(
+        malloc(LIBUSB_CONTROL_SETUP_SIZE + G13_SET_REPORT_MAX));
+    if (!queue.transfer || !buffer) {
+      libusb_free_transfer(queue.transfer);
+      free(buffer);
+      m_reports.erase(value);
+      return LIBUSB_ERROR_NO_MEM;
+    }
+    libusb_fill_control_transfer(queue.transfer, m_handle, buffer,
+                                 ReportTransferCallback, &queue, 1000);
+    queue.transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  }
+  return SubmitReport(queue, data, size);
+}
+
+int G13_LibusbTransport::SubmitReport(ReportQueue &queue,
+                                      const unsigned char *data,
+                                      uint16_t size) {
+  // the setup packet carries the length, fill it in for every request
+  libusb_fill_control_setup(
+      queue.transfer->buffer,
+      LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE, 9, queue.value,
+      0, size);
+  memcpy(queue.transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, size);
+  queue.transfer->length = LIBUSB_CONTROL_SETUP_SIZE + size;
+  int error = libusb_submit_transfer(queue.transfer);
+  if (error == LIBUSB_SUCCESS) {
+    queue.busy = true;
+  }
+  return error;
+}
+
+void LIBUSB_CALL
+G13_LibusbTransport::ReportTransferCallback(libusb_transfer *transfer) {
+  auto &queue = *static_cast<ReportQueue *>(transfer->user_data);
+  auto &stats = queue.transport->m_g13->stats();
+  queue.busy = false;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    G13_Stats::count(stats.control_transfers);
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    G13_Stats::count(stats.usb_timeouts);
+    G13_ERR("Error when setting report: "
+            << DescribeTransferStatus(transfer->status));
+    break;
+  default:
+    G13_Stats::count(stats.usb_errors);
+    G13_ERR("Error when setting report: "
+            << DescribeTransferStatus(transfer->status));
+    break;
+  }
+
+  if (queue.has_pending) {
+    queue.has_pending = false;
+    int error =
+        queue.transport->SubmitReport(queue, queue.pending, queue.pending_size);
+    if (error != LIBUSB_SUCCESS) {
+      G13_ERR("Error when setting report: "
+              << G13_Device::DescribeLibusbErrorCode(error));
+    }
+  }
+}
+
+void G13_LibusbTransport::StopReports() {
+  // let the requests in flight and the ones waiting behind them finish,
+  // each is bounded by its timeout
+  auto busy = [this]() {
+    for (auto &report : m_reports) {
+      if (report.second.busy)
+        return true;
+    }
+    return false;
+  };
+  while (busy()) {
+    if (libusb_handle_events(m_ctx) != LIBUSB_SUCCESS)
+      break;
+  }
+  for (auto &report : m_reports) {
+    if (report.second.busy) {
+      G13_ERR("Report transfer still pending, leaking");
+    } else if (report.second.transfer) {
+      libusb_free_transfer(report.second.transfer);
+    }
+  }
+  m_reports.clear();
+}
+
+void G13_LibusbTransport::StartKeyReader() {
+  int count = 4;
+  auto configured = G13_Manager::getStringConfigValue("key_transfers");
+  if (!configured.empty()) {
+    count = std::max(1, atoi(configured.c_str()));
+  }
+
+  // Keep several reads queued so the endpoint is never left without one,
+  // even while a slow action is running
+  while (m_key_transfers.size() < (size_t)count) {
+    auto transfer = libusb_alloc_transfer(0);
+    if (!transfer) {
+      G13_ERR("Cannot allocate key transfer");
+      break;
+    }
+    auto buffer = static_cast<unsigned char *>(malloc(G13_REPORT_SIZE));
+    libusb_fill_interrupt_transfer(transfer, m_handle,
+                                   LIBUSB_ENDPOINT_IN | G13_KEY_ENDPOINT,
+                                   buffer, G13_REPORT_SIZE,
+                                   KeyTransferCallback, this, 0);
+    transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+    m_key_transfers.push_back(transfer);
+    SubmitKeyTransfer(transfer);
+  }
+  G13_DBG(m_key_transfers_busy << " key transfers queued");
+}
+
+void G13_LibusbTransport::StopKeyReader() {
+  G13_Manager::RemoveTimer(m_key_retry_timer);
+  m_key_retry_timer = -1;
+  m_key_retries.clear();
+  int cancelled = 0;
+  for (auto transfer : m_key_transfers) {
+    if (libusb_cancel_transfer(transfer) == LIBUSB_SUCCESS)
+      cancelled++;
+  }
+  if (cancelled) {
+    // Wait for the cancellations to be reported back
+    while (m_key_transfers_busy) {
+      if (libusb_handle_events(m_ctx) != LIBUSB_SUCCESS)
+        break;
+    }
+  }
+  if (m_key_transfers_busy) {
+    G13_ERR(m_key_transfers_busy << " key transfers still pending, leaking");
+  } else {
+    for (auto transfer : m_key_transfers) {
+      libusb_free_transfer(transfer);
+    }
+  }
+  m_key_transfers.clear();
+}
+
+void G13_LibusbTransport::SubmitKeyTransfer(libusb_transfer *transfer) {
+  int error = libusb_submit_transfer(transfer);
+  if (error != LIBUSB_SUCCESS) {
+    G13_ERR("Error while reading keys: "
+            << G13_Device::DescribeLibusbErrorCode(error));
+    return;
+  }
+  m_key_transfers_busy++;
+}
+
+void LIBUSB_CALL
+G13_LibusbTransport::KeyTransferCallback(libusb_transfer *transfer) {
+  auto self = static_cast<G13_LibusbTransport *>(transfer->user_data);
+  auto &stats = self->m_g13->stats();
+  self->m_key_transfers_busy--;
+
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    if (self->m_key_errors) {
+      G13_OUT("Reading keys again after " << self->m_key_errors
+                                          << " errors");
+      self->m_key_errors = 0;
+      self->m_key_retry_ms = G13_KEY_RETRY_MIN_MS;
+    }
+    if (transfer->actual_length == G13_REPORT_SIZE) {
+      self->m_g13->ReadKeypresses(transfer->buffer);
+    }
+    break;
+  case LIBUSB_TRANSFER_CANCELLED:
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    return;
+  default:
+    G13_Stats::count(stats.usb_errors);
+    self->KeyTransferFailed(transfer);
+    return;
+  }
+  self->SubmitKeyTransfer(transfer);
+}
+
+void G13_LibusbTransport::KeyTransferFailed(libusb_transfer *transfer) {
+  m_key_errors++;
+  if (m_key_errors <= G13_KEY_ERROR_LIMIT) {
+    G13_ERR("Error while reading keys: "
+            << DescribeTransferStatus(transfer->status));
+  } else if (m_key_errors == G13_KEY_ERROR_LIMIT + 1) {
+    G13_ERR("Key reads keep failing, retrying with a delay");
+  }
+
+  if (transfer->status == LIBUSB_TRANSFER_STALL) {
+    int error = libusb_clear_halt(m_handle, transfer->endpoint);
+    if (error != LIBUSB_SUCCESS && m_key_errors <= G13_KEY_ERROR_LIMIT) {
+      G13_ERR("Cannot clear key endpoint halt: "
+              << G13_Device::DescribeLibusbErrorCode(error));
+    }
+  }
+
+  if (m_key_errors < G13_KEY_ERROR_LIMIT) {
+    SubmitKeyTransfer(transfer);
+    return;
+  }
+  m_key_retries.push_back(transfer);
+  if (m_key_retry_timer < 0) {
+    m_key_retry_timer = G13_Manager::AddTimer(
+        m_key_retry_ms, [this]() { RetryKeyTransfers(); });
+    m_key_retry_ms = std::min(m_key_retry_ms * 2, G13_KEY_RETRY_MAX_MS);
+  }
+}
+
+void G13_LibusbTransport::RetryKeyTransfers() {
+  G13_Manager::RemoveTimer(m_key_retry_timer);
+  m_key_retry_timer = -1;
+  auto retries = std::move(m_key_retries);
+  m_key_retries.clear();
+  for (auto transfer : retries) {
+    SubmitKeyTransfer(transfer);
+  }
+}
+
+} // namespace G13
@@ -0,0 +1,171 @@
+//
+// USB transports used by G13_Device
+//
+
+#ifndef G13_G13_TRANSPORT_HPP
+#define G13_G13_TRANSPORT_HPP
+
+#include "g13_lcd.hpp"
+#include <cstdint>
+#include <libusb-1.0/libusb.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace G13 {
+class G13_Device;
+
+// largest report SetReport() takes
+const uint16_t G13_SET_REPORT_MAX = 64;
+
+/*
+ * Failed key reads are resubmitted right away until this many fail in a
+ * row, then retried after a delay doubling up to G13_KEY_RETRY_MAX_MS.
+ */
+const unsigned G13_KEY_ERROR_LIMIT = 8;
+const unsigned G13_KEY_RETRY_MIN_MS = 50;
+const unsigned G13_KEY_RETRY_MAX_MS = 2000;
+
+/*!
+ * everything G13_Device sends to or receives from the keypad
+ *
+ * Key reports are delivered asynchronously to G13_Device::ReadKeypresses()
+ * of the attached device once StartKeyReader() has been called. The other
+ * methods return libusb error codes.
+ */
+class G13_Transport {
+public:
+  virtual ~G13_Transport();
+
+  void attach(G13_Device *g13) { m_g13 = g13; }
+
+  virtual int InitLcd() = 0;
+
+  /*!
+   * data holds one G13_LCD_BUFFER_SIZE bytes image in G13 layout. The
+   * image may be sent after the call returns, data is copied.
+   */
+  virtual int WriteLcd(const unsigned char *data) = 0;
+
+  /*!
+   * HID SET_REPORT, value is the report type and id (0x305 mode LEDs,
+   * 0x307 backlight colour). The report may be sent after the call
+   * returns, and be superseded by a later one with the same value.
+   */
+  virtual int SetReport(uint16_t value, unsigned char *data,
+                        uint16_t size) = 0;
+
+  virtual void StartKeyReader() = 0;
+
+  virtual void StopKeyReader() = 0;
+
+  /*!
+   * stops reading keys and waits for the LCD and report transfers still
+   * queued, whose completions touch the attached device. Called by the
+   * device while it can still take them.
+   */
+  virtual void Stop() = 0;
+
+  // the USB device, used to match hotplug events
+  [[nodiscard]] virtual libusb_device *Device() const = 0;
+
+protected:
+  G13_Device *m_g13 = nullptr;
+};
+
+/*!
+ * the real thing, talks to the keypad through libusb
+ */
+class G13_LibusbTransport : public G13_Transport {
+public:
+  G13_LibusbTransport(libusb_device *dev, libusb_context *ctx,
+                      libusb_device_handle *handle);
+  ~G13_LibusbTransport() override;
+
+  int InitLcd() override;
+  int WriteLcd(const unsigned char *data) override;
+  int SetReport(uint16_t value, unsigned char *data, uint16_t size) override;
+  void StartKeyReader() override;
+  void StopKeyReader() override;
+  void Stop() override;
+
+  [[nodiscard]] libusb_device *Device() const override { return m_device; }
+
+  static std::string DescribeTransferStatus(int status);
+
+protected:
+  void SubmitKeyTransfer(libusb_transfer *transfer);
+
+  static void LIBUSB_CALL KeyTransferCallback(libusb_transfer *transfer);
+
+  // a key read failed, resubmits it now or after a delay
+  void KeyTransferFailed(libusb_transfer *transfer);
+
+  // resubmits the key reads held back by KeyTransferFailed()
+  void RetryKeyTransfers();
+
+  // sends the frame staged in m_lcd_buffer
+  int SubmitLcdTransfer();
+
+  static void LIBUSB_CALL LcdTransferCallback(libusb_transfer *transfer);
+
+  void StopLcd();
+
+  /*
+   * SET_REPORT requests go out one at a time per report value. A request
+   * made while one is in flight waits in pending, where a later request
+   * for the same report replaces it; only the latest colour or LED state
+   * is worth sending.
+   */
+  struct ReportQueue {
+    G13_LibusbTransport *transport;
+    uint16_t value;
+    libusb_transfer *transfer = nullptr; // setup packet and data
+    bool busy = false;
+    bool has_pending = false;
+    uint16_t pending_size = 0;
+    unsigned char pending[G13_SET_REPORT_MAX]{};
+  };
+
+  int SubmitReport(ReportQueue &queue, const unsigned char *data,
+                   uint16_t size);
+
+  static void LIBUSB_CALL ReportTransferCallback(libusb_transfer *transfer);
+
+  // waits for queued reports to be sent, so the last colour set sticks
+  void StopReports();
+
+  libusb_context *m_ctx;
+  libusb_device_handle *m_handle;
+  libusb_device *m_device;
+
+  // interrupt transfers kept queued on the key endpoint
+  std::vector<libusb_transfer *> m_key_transfers;
+  int m_key_transfers_busy;
+  // failed key reads since the last one completing, and the reads waiting
+  // for m_key_retry_timer
+  unsigned m_key_errors = 0;
+  std::vector<libusb_transfer *> m_key_retries;
+  int m_key_retry_timer = -1;
+  unsigned m_key_retry_ms = G13_KEY_RETRY_MIN_MS;
+
+  /*
+   * LCD frames are sent one at a time from a buffer kept for the lifetime
+   * of the transport, in DMA-able memory where libusb can provide it. A
+   * frame arriving while one is in flight waits in m_lcd_pending, and is
+   * replaced by any later frame.
+   */
+  libusb_transfer *m_lcd_transfer = nullptr;
+  unsigned char *m_lcd_buffer = nullptr;
+  bool m_lcd_buffer_pinned = false;
+  bool m_lcd_busy = false;
+  bool m_lcd_has_pending = false;
+  unsigned char m_lcd_pending[G13_LCD_BUFFER_SIZE]{};
+
+  // by report value
+  std::map<uint16_t, ReportQueue> m_reports;
+};
+
+} // namespace G13
+
+#endif // G13_G13_TRANSPORT_HPP
@@ -0,0 +1,239 @@
+//
+// LCD widgets: clock, CPU, memory and temperature readouts drawn by the
+// daemon itself on a timer
+//
+
+#include "g13_widget.hpp"
+#include "g13.hpp"
+#include "g13_device.hpp"
+#include "g13_fonts.hpp"
+#include <dirent.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <unistd.h>
+
+namespace G13 {
+
+// sources change slower than the clock, read them once a second
+static const unsigned G13_WIDGET_SOURCE_PERIOD = 1000 / G13_WIDGET_TICK_MS;
+
+G13_Widget::G13_Widget(G13_Device &keypad, std::string name, int x, int y,
+                       unsigned period)
+    : m_keypad(keypad), m_font(keypad.current_font_ptr()),
+      m_name(std::move(name)), m_x(x), m_y(y), m_period(period) {}
+
+G13_Widget::~G13_Widget() = default;
+
+bool G13_Widget::Update() {
+  if (m_ticks++ % m_period)
+    return false;
+  std::string text;
+  if (!Read(text))
+    text = "?";
+  if (text == m_text)
+    return false;
+
+  auto &lcd = m_keypad.lcd();
+  unsigned width = text.size() * m_font->width();
+  if (width < m_width) {
+    lcd.Rect(m_x + width, m_y, m_width - width, G13_LCD_TEXT_CHEIGHT,
+             G13_LCD_CLEAR, true);
+  }
+  lcd.DrawText(m_x, m_y, text, *m_font);
+  m_text = std::move(text);
+  m_width = width;
+  return true;
+}
+
+void G13_Widget::Erase() {
+  m_keypad.lcd().Rect(m_x, m_y, m_width, G13_LCD_TEXT_CHEIGHT, G13_LCD_CLEAR,
+                      true);
+  m_text.clear();
+  m_width = 0;
+}
+
+void G13_Widget::dump(std::ostream &o) const {
+  o << "   " << std::setw(12) << m_name << " at " << m_x << "," << m_y
+    << " font " << m_font->name() << " showing " << Helper::repr(m_text);
+}
+
+int G13_Widget::OpenSource(const std::string &filename) {
+  int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw G13_CommandException("cannot open " + filename + ": " +
+                               strerror(errno));
+  }
+  return fd;
+}
+
+ssize_t G13_Widget::ReadSource(int fd, char *buffer, size_t size) {
+  ssize_t length = pread(fd, buffer, size - 1, 0);
+  buffer[length > 0 ? length : 0] = 0;
+  return length;
+}
+
+std::unique_ptr<G13_Widget> G13_Widget::Make(G13_Device &keypad,
+                                             const std::string &name,
+                                             const std::string &type, int x,
+                                             int y, const char *args) {
+  std::string sensor;
+  if (type == "clock") {
+    args = Helper::ltrim(args);
+    return std::make_unique<G13_ClockWidget>(keypad, name, x, y,
+                                             *args ? args : "%H:%M:%S");
+  } else if (type == "cpu") {
+    return std::make_unique<G13_CpuWidget>(keypad, name, x, y,
+                                           Helper::ltrim(args));
+  } else if (type == "mem") {
+    return std::make_unique<G13_MemWidget>(keypad, name, x, y,
+                                           Helper::ltrim(args));
+  } else if (type == "temp") {
+    Helper::advance_ws(args, sensor);
+    return std::make_unique<G13_TempWidget>(keypad, name, x, y, sensor,
+                                            Helper::ltrim(args));
+  }
+  throw G13_CommandException("unknown widget type : " + type);
+}
+
+// *************************************************************************
+
+G13_ClockWidget::G13_ClockWidget(G13_Device &keypad, std::string name, int x,
+                                 int y, std::string format)
+    : G13_Widget(keypad, std::move(name), x, y, 1),
+      m_format(std::move(format)) {}
+
+bool G13_ClockWidget::Read(std::string &text) {
+  char buffer[G13_LCD_COLUMNS + 1];
+  time_t now = time(nullptr);
+  struct tm local {};
+  localtime_r(&now, &local);
+  size_t length = strftime(buffer, sizeof(buffer), m_format.c_str(), &local);
+  text.assign(buffer, length);
+  return true;
+}
+
+void G13_ClockWidget::dump(std::ostream &o) const {
+  G13_Widget::dump(o);
+  o << " clock " << Helper::repr(m_format) << std::endl;
+}
+
+// *************************************************************************
+
+G13_SourceWidget::G13_SourceWidget(G13_Device &keypad, std::string name,
+                                   int x, int y, const std::string &filename,
+                                   std::string label)
+    : G13_Widget(keypad, std::move(name), x, y, G13_WIDGET_SOURCE_PERIOD),
+      m_fd(OpenSource(filename)), m_filename(filename),
+      m_label(std::move(label)) {}
+
+G13_SourceWidget::~G13_SourceWidget() { close(m_fd); }
+
+bool G13_SourceWidget::Read(std::string &text) {
+  char source[4096];
+  int value;
+  if (ReadSource(m_fd, source, sizeof(source)) <= 0 || !Value(source, value))
+    return false;
+  char number[16];
+  snprintf(number, sizeof(number), "%3d", value);
+  text.assign(m_label);
+  text.append(number);
+  text.append(unit());
+  return true;
+}
+
+void G13_SourceWidget::dump(std::ostream &o) const {
+  G13_Widget::dump(o);
+  o << " from " << m_filename << std::endl;
+}
+
+G13_CpuWidget::G13_CpuWidget(G13_Device &keypad, std::string name, int x,
+                             int y, std::string label)
+    : G13_SourceWidget(keypad, std::move(name), x, y, "/proc/stat",
+                       label.empty() ? "CPU " : std::move(label)) {}
+
+bool G13_CpuWidget::Value(const char *source, int &value) {
+  // cpu  user nice system idle iowait irq softirq steal ...
+  unsigned long long fields[8]{};
+  if (sscanf(source, "cpu %llu %llu %llu %llu %llu %llu %llu %llu", &fields[0],
+             &fields[1], &fields[2], &fields[3], &fields[4], &fields[5],
+             &fields[6], &fields[7]) < 4)
+    return false;
+  uint64_t total = 0;
+  for (auto field : fields)
+    total += field;
+  uint64_t busy = total - fields[3] - fields[4];
+  if (total == m_total) {
+    value = 0;
+  } else {
+    value = (int)(100 * (busy - m_busy) / (total - m_total));
+  }
+  m_busy = busy;
+  m_total = total;
+  return true;
+}
+
+G13_MemWidget::G13_MemWidget(G13_Device &keypad, std::string name, int x,
+                             int y, std::string label)
+    : G13_SourceWidget(keypad, std::move(name), x, y, "/proc/meminfo",
+                       label.empty() ? "MEM " : std::move(label)) {}
+
+bool G13_MemWidget::Value(const char *source, int &value) {
+  auto total = strstr(source, "MemTotal:");
+  auto available = strstr(source, "MemAvailable:");
+  if (!total || !available)
+    return false;
+  uint64_t total_kb = strtoull(total + 9, nullptr, 10);
+  uint64_t available_kb = strtoull(available + 13, nullptr, 10);
+  if (!total_kb || available_kb > total_kb)
+    return false;
+  value = (int)(100 * (total_kb - available_kb) / total_kb);
+  return true;
+}
+
+G13_TempWidget::G13_TempWidget(G13_Device &keypad, std::string name, int x,
+                               int y, const std::string &sensor,
+                               std::string label)
+    : G13_SourceWidget(keypad, std::move(name), x, y, SensorFile(sensor),
+                       std::move(label)) {}
+
+std::string G13_TempWidget::SensorFile(const std::string &sensor) {
+  if (!sensor.empty() && sensor[0] == '/')
+    return sensor;
+
+  const std::string hwmon = "/sys/class/hwmon/";
+  auto slash = sensor.find('/');
+  std::string chip = sensor.substr(0, slash);
+  std::string input =
+      slash == std::string::npos ? "temp1" : sensor.substr(slash + 1);
+
+  std::vector<std::string> devices;
+  if (DIR *dir = opendir(hwmon.c_str())) {
+    while (auto entry = readdir(dir)) {
+      if (entry->d_name[0] != '.')
+        devices.emplace_back(entry->d_name);
+    }
+    closedir(dir);
+  }
+  std::sort(devices.begin(), devices.end());
+  for (auto &device : devices) {
+    std::string name;
+    std::ifstream(hwmon + device + "/name") >> name;
+    if (chip.empty() || name == chip)
+      return hwmon + device + "/" + input + "_input";
+  }
+  throw G13_CommandException("no hwmon sensor " + sensor);
+}
+
+bool G13_TempWidget::Value(const char *source, int &value) {
+  char *end;
+  long millidegrees = strtol(source, &end, 10);
+  if (end == source)
+    return false;
+  value = (int)(millidegrees / 1000);
+  return true;
+}
+
+} // namespace G13
@@ -0,0 +1,155 @@
+//
+// LCD widgets: clock, CPU, memory and temperature readouts drawn by the
+// daemon itself on a timer
+//
+
+#ifndef G13_G13_WIDGET_HPP
+#define G13_G13_WIDGET_HPP
+
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+namespace G13 {
+class G13_Device;
+class G13_Font;
+
+// widgets are looked at every tick, and read their source every period
+const unsigned G13_WIDGET_TICK_MS = 250;
+
+/*!
+ * a line of text at a fixed position of the LCD, redrawn when it changes
+ *
+ * Widgets only draw into their own region of the LCD buffer, sending the
+ * buffer is up to the device.
+ */
+class G13_Widget {
+public:
+  G13_Widget(G13_Device &keypad, std::string name, int x, int y,
+             unsigned period);
+  virtual ~G13_Widget();
+
+  // called every tick, true when the widget was redrawn
+  bool Update();
+
+  // erases what the widget drew
+  void Erase();
+
+  [[nodiscard]] const std::string &name() const { return m_name; }
+
+  virtual void dump(std::ostream &o) const;
+
+  // creates a widget of type, throws G13_CommandException
+  static std::unique_ptr<G13_Widget> Make(G13_Device &keypad,
+                                          const std::string &name,
+                                          const std::string &type, int x,
+                                          int y, const char *args);
+
+protected:
+  // the text to show, or false when the value could not be read
+  virtual bool Read(std::string &text) = 0;
+
+  // opens a source read again every period, throws G13_CommandException
+  static int OpenSource(const std::string &filename);
+  // reads a source from its start into buffer, NUL terminated
+  static ssize_t ReadSource(int fd, char *buffer, size_t size);
+
+  G13_Device &m_keypad;
+  std::shared_ptr<G13_Font> m_font;
+  std::string m_name;
+  int m_x;
+  int m_y;
+  unsigned m_period; // in ticks
+  unsigned m_ticks{};
+
+  std::string m_text; // as drawn
+  unsigned m_width{};  // of m_text in pixels
+};
+
+/*!
+ * local time, formatted with strftime
+ */
+class G13_ClockWidget : public G13_Widget {
+public:
+  G13_ClockWidget(G13_Device &keypad, std::string name, int x, int y,
+                  std::string format);
+
+  void dump(std::ostream &o) const override;
+
+protected:
+  bool Read(std::string &text) override;
+
+  std::string m_format;
+};
+
+/*!
+ * a percentage or temperature read from a file under /proc or /sys, shown
+ * after a label
+ */
+class G13_SourceWidget : public G13_Widget {
+public:
+  G13_SourceWidget(G13_Device &keypad, std::string name, int x, int y,
+                   const std::string &filename, std::string label);
+  ~G13_SourceWidget() override;
+
+  void dump(std::ostream &o) const override;
+
+protected:
+  bool Read(std::string &text) override;
+
+  // the value shown, from the source text just read
+  virtual bool Value(const char *source, int &value) = 0;
+  virtual const char *unit() const = 0;
+
+  int m_fd;
+  std::string m_filename;
+  std::string m_label;
+};
+
+// busy share of all CPUs since the last period, from /proc/stat
+class G13_CpuWidget : public G13_SourceWidget {
+public:
+  G13_CpuWidget(G13_Device &keypad, std::string name, int x, int y,
+                std::string label);
+
+protected:
+  bool Value(const char *source, int &value) override;
+  const char *unit() const override { return "%"; }
+
+  uint64_t m_busy{};
+  uint64_t m_total{};
+};
+
+// memory in use, from MemTotal and MemAvailable of /proc/meminfo
+class G13_MemWidget : public G13_SourceWidget {
+public:
+  G13_MemWidget(G13_Device &keypad, std::string name, int x, int y,
+                std::string label);
+
+protected:
+  bool Value(const char *source, int &value) override;
+  const char *unit() const override { return "%"; }
+};
+
+// a hwmon temperature input, in degrees Celsius
+class G13_TempWidget : public G13_SourceWidget {
+public:
+  G13_TempWidget(G13_Device &keypad, std::string name, int x, int y,
+                 const std::string &sensor, std::string label);
+
+  /*!
+   * the file of a sensor given as a path, or as <chip>/<input> with chip
+   * the name of a hwmon device, like coretemp/temp1. An empty sensor is
+   * temp1 of the first hwmon device.
+   */
+  static std::string SensorFile(const std::string &sensor);
+
+protected:
+  bool Value(const char *source, int &value) override;
+  const char *unit() const override { return "C"; }
+};
+
+} // namespace G13
+
+#endif // G13_G13_WIDGET_HPP
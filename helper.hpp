@@ -32,6 +32,7 @@
 #define __HELPER_HPP__
 
 #include <string>
+#include <string_view>
 #include <cstring>
 #include <iomanip>
 #include <map>
@@ -154,6 +155,16 @@ inline const char *advance_ws(CCP &source, std::string &dest) {
   return source;
 }
 
+// same as above, without copying the word
+inline const char *advance_ws(CCP &source, std::string_view &dest) {
+  size_t l;
+  source = ltrim(source);
+  l = strcspn(source, "# \t");
+  dest = std::string_view(source, l);
+  source = !source[l] || source[l] == '#'? "": source + l + 1;
+  return source;
+}
+
 // *************************************************************************
 
 template <class MAP_T> struct _map_keys_out {
@@ -6,8 +6,10 @@
 #include <iostream>
 
 // convert a .pbm raw file to our custom .lpbm format
+// with -f the image is preceded by a frame header, see G13_FrameHeader
 
 int main(int argc, char* argv[]) {
+    bool framed = argc > 1 && !std::strcmp(argv[1], "-f");
     unsigned char c;
     const int LEN = 256;
     char s[LEN];
@@ -52,6 +54,11 @@ int main(int argc, char* argv[]) {
         std::cerr << "wrong number of bytes, expected " << 160 * 43 / 8 << ", got " << i
                   << std::endl;
     }
+    if (framed) {
+        const unsigned char header[8] = {0x1b, 'G', '1', '3', 1, 0,
+                                         (160 * 48 / 8) & 0xff, (160 * 48 / 8) >> 8};
+        std::cout.write(reinterpret_cast<const char *>(header), sizeof(header));
+    }
     for (int i = 0; i < 160 * 48 / 8; i++) {
         std::cout << std::hex << (char)buf[i];
     }
@@ -13,8 +13,15 @@
 #include "g13.hpp"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "g13_events.hpp"
 #include "g13_manager.hpp"
 #include "g13_profile.hpp"
+#include "g13_replay.hpp"
+#include "g13_stats.hpp"
+#include <algorithm>
+#include <fcntl.h>
+#include <sstream>
+#include <sys/socket.h>
 
 /*
 class MockManager : public G13::G13_Manager {
@@ -35,6 +42,82 @@ class MockProfile : public G13::G13_Profile {
     MockProfile(G13::G13_Device& device) : G13_Profile(device, std::string("mock")) {}
 };
 
+// a device without a keypad, reading its input pipe from a pipe of the test
+class PipeDevice : public G13::G13_Device {
+   public:
+    PipeDevice()
+        : G13_Device(std::make_unique<G13::G13_ReplayTransport>(
+                         std::vector<G13::G13_ReplayReport>{}, false),
+                     0) {
+        EXPECT_EQ(pipe(m_fds), 0);
+        m_input_pipe_fid = m_fds[0];
+    }
+    // the read end is the input pipe, closed by G13_Device::Cleanup()
+    ~PipeDevice() { close(m_fds[1]); }
+
+    // writes data as one read's worth of pipe input and handles it
+    void Feed(const std::string& data) {
+        EXPECT_EQ(write(m_fds[1], data.data(), data.size()), (ssize_t)data.size());
+        while (Pending()) {
+            ReadCommandsFromPipe();
+        }
+    }
+
+    void SetPipeBufferSize(size_t size) { m_pipe_buffer.resize(size); }
+    void SetBareImages(bool bare) { m_bare_images = bare; }
+
+    using G13_Device::LcdInit;
+
+    const G13::G13_ReplayTransport& replay() const {
+        return static_cast<const G13::G13_ReplayTransport&>(*m_transport);
+    }
+
+    // runs a command, failing with its exception
+    void Run(const std::string& command) {
+        std::ostringstream out;
+        RunCommand(command.c_str(), out);
+    }
+
+    // a key report with the stick at x, y
+    void MoveStick(int x, int y) {
+        unsigned char report[G13::G13_REPORT_SIZE]{};
+        report[1] = x;
+        report[2] = y;
+        stick().ParseJoystick(report);
+    }
+
+    // key events queued since the last call, as key code and value
+    std::vector<std::pair<int, int>> TakeKeys() {
+        std::vector<std::pair<int, int>> keys;
+        for (size_t i = 0; i < m_event_count; i++) {
+            if (m_events[i].type == EV_KEY) {
+                keys.emplace_back(m_events[i].code, m_events[i].value);
+            }
+        }
+        m_event_count = 0;
+        return keys;
+    }
+
+   protected:
+    bool Pending() {
+        int bytes = 0;
+        ioctl(m_fds[0], FIONREAD, &bytes);
+        return bytes > 0;
+    }
+
+    int m_fds[2];
+};
+
+static std::string LcdFrame(unsigned char fill) {
+    G13::G13_FrameHeader header{};
+    memcpy(header.magic, G13::G13_FRAME_MAGIC, sizeof(header.magic));
+    header.type = G13::G13_FRAME_LCD;
+    header.length = htole16(G13::G13_LCD_BUF_SIZE);
+    std::string frame(reinterpret_cast<const char*>(&header), sizeof(header));
+    frame.append(G13::G13_LCD_BUF_SIZE, (char)fill);
+    return frame;
+}
+
 // class MockProfile : public G13::G13_Profile {
 // public:
 //    G13_Profile(G13_Device& keypad, const std::string& name_arg)
@@ -57,6 +140,471 @@ TEST(G13Key, g13_key_maps_to_value) {
     // EXPECT_EQ(key->index(), 10);
 }
 
+TEST(G13Histogram, small_values_have_buckets_of_their_own) {
+    for (uint64_t value = 0; value < 16; value++) {
+        EXPECT_EQ(G13::G13_Histogram::bucket_index(value), value);
+        EXPECT_EQ(G13::G13_Histogram::bucket_upper(value), value);
+    }
+    EXPECT_EQ(G13::G13_Histogram::bucket_index(16), 16u);
+}
+
+TEST(G13Histogram, buckets_hold_their_values_within_an_eighth) {
+    unsigned last = 0;
+    for (uint64_t value = 1; value < (uint64_t(1) << 62); value += value / 7 + 1) {
+        unsigned index = G13::G13_Histogram::bucket_index(value);
+        uint64_t upper = G13::G13_Histogram::bucket_upper(index);
+        EXPECT_GE(index, last);
+        EXPECT_GE(upper, value);
+        EXPECT_LE(upper - value, value / 8);
+        if (index) {
+            EXPECT_LT(G13::G13_Histogram::bucket_upper(index - 1), value);
+        }
+        last = index;
+    }
+    uint64_t largest = UINT64_MAX;
+    EXPECT_EQ(G13::G13_Histogram::bucket_upper(
+                  G13::G13_Histogram::bucket_index(largest)), largest);
+}
+
+TEST(G13Histogram, percentiles_come_from_the_buckets) {
+    G13::G13_Histogram histogram;
+    for (uint64_t value = 1; value <= 1000; value++) {
+        histogram.record(value * 1000);
+    }
+    EXPECT_EQ(histogram.count(), 1000u);
+    uint64_t p50 = histogram.percentile(50);
+    EXPECT_GE(p50, 500000u);
+    EXPECT_LE(p50, 500000u + 500000u / 8);
+    EXPECT_EQ(histogram.percentile(100), 1000000u);
+    histogram.reset();
+    EXPECT_EQ(histogram.count(), 0u);
+    EXPECT_EQ(histogram.percentile(50), 0u);
+}
+
+TEST(G13Pipe, frames_split_across_reads_reach_the_lcd) {
+    PipeDevice device;
+    auto frame = LcdFrame(0x5a);
+    device.Feed("rgb 1 2 3\n" + frame.substr(0, 5));
+    device.Feed(frame.substr(5, 300));
+    // nothing of a frame reaches the LCD before all of it has
+    EXPECT_EQ(device.lcd().image_buf[0], 0);
+    device.Feed(frame.substr(305) + "rgb 4 5 6\n");
+    EXPECT_EQ(device.lcd().image_buf[0], 0x5a);
+    EXPECT_EQ(device.lcd().image_buf[G13::G13_LCD_BUF_SIZE - 1], 0x5a);
+    EXPECT_EQ(device.key_color().red, 4);
+}
+
+TEST(G13Pipe, unknown_frames_are_skipped) {
+    PipeDevice device;
+    G13::G13_FrameHeader header{};
+    memcpy(header.magic, G13::G13_FRAME_MAGIC, sizeof(header.magic));
+    header.type = 99;
+    header.length = htole16(3);
+    device.Feed(std::string(reinterpret_cast<const char*>(&header), sizeof(header)) +
+                "abcrgb 7 8 9\n");
+    EXPECT_EQ(device.key_color().red, 7);
+}
+
+TEST(G13Pipe, bare_images_can_be_turned_off) {
+    std::string commands = "rgb 1 1 1\n";
+    commands.append(G13::G13_LCD_BUFFER_SIZE - commands.size() - 10, ' ');
+    commands.append("rgb 2 2 2\n");
+    ASSERT_EQ(commands.size(), G13::G13_LCD_BUFFER_SIZE);
+
+    PipeDevice bare;
+    bare.Feed(commands);
+    EXPECT_EQ(bare.key_color().red, 0);
+    EXPECT_EQ(bare.lcd().image_buf[0], 'r');
+
+    PipeDevice framed;
+    framed.SetBareImages(false);
+    framed.Feed(commands);
+    EXPECT_EQ(framed.key_color().red, 2);
+}
+
+TEST(G13Pipe, lines_split_across_reads_run_once_complete) {
+    PipeDevice device;
+    device.Feed("rgb 1 2 3\nrgb 4");
+    EXPECT_EQ(device.key_color().red, 1);
+    device.Feed(" 5 6");
+    EXPECT_EQ(device.key_color().red, 1);
+    device.Feed("\r\n\n  \nrgb 7 8 9\r");
+    EXPECT_EQ(device.key_color(), (G13::G13_Color{7, 8, 9}));
+}
+
+TEST(G13Pipe, overlong_lines_are_dropped) {
+    PipeDevice device;
+    device.SetPipeBufferSize(16);
+    device.Feed("rgb 1 2 3\nrgb 9 9 9" + std::string(40, ' '));
+    device.Feed(std::string(20, ' ') + "\nrgb 4 5 6\n");
+    EXPECT_EQ(device.key_color(), (G13::G13_Color{4, 5, 6}));
+    // a line filling the buffer but for its end still runs
+    device.Feed("rgb 7 8 9" + std::string(6, ' ') + "\n");
+    EXPECT_EQ(device.key_color().red, 7);
+}
+
+TEST(G13Lcd, frames_are_resent_after_other_writes_to_the_lcd) {
+    PipeDevice device;
+    unsigned char image[G13::G13_LCD_BUF_SIZE];
+    memset(image, 0x33, sizeof(image));
+    auto show = [&]() {
+        device.lcd().Image(image, sizeof(image));
+        device.lcd().Flush();
+        return device.replay().lcd_frames();
+    };
+    size_t frames = show();
+    EXPECT_EQ(show(), frames);
+    device.LcdInit();
+    EXPECT_EQ(device.replay().lcd_frames(), frames + 1);
+    EXPECT_EQ(show(), frames + 2);
+}
+
+// everything the subscriber writes, read from the other end fd whenever the
+// subscriber has to wait; fd is non-blocking
+static std::vector<std::string> DrainAll(G13::G13_EventSubscriber& subscriber, int fd,
+                                         bool packets) {
+    std::vector<std::string> received;
+    std::string stream;
+    char buf[65536];
+    do {
+        EXPECT_TRUE(subscriber.Drain());
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            if (packets) {
+                received.emplace_back(buf, n);
+            } else {
+                stream.append(buf, n);
+            }
+        }
+    } while (!subscriber.empty());
+    for (size_t beg = 0, end; (end = stream.find('\n', beg)) != std::string::npos;
+         beg = end + 1) {
+        received.push_back(stream.substr(beg, end - beg));
+    }
+    return received;
+}
+
+static std::string Dump(const G13::G13_EventSubscriber& subscriber) {
+    std::ostringstream o;
+    subscriber.dump(o);
+    return o.str();
+}
+
+TEST(G13Events, slow_subscribers_lose_the_oldest_events) {
+    int fds[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, fds), 0);
+    {
+        G13::G13_EventSubscriber subscriber(fds[0], G13::G13_EVENT_ALL, true, false, false);
+        size_t extra = 10;
+        for (size_t i = 0; i < G13::G13_EVENT_QUEUE + extra; i++) {
+            subscriber.Push(G13::G13_EVENT_KEY, "G" + std::to_string(i) + " down");
+        }
+        auto received = DrainAll(subscriber, fds[1], true);
+        ASSERT_EQ(received.size(), G13::G13_EVENT_QUEUE);
+        EXPECT_EQ(received.front(), "key G" + std::to_string(extra) + " down");
+        EXPECT_EQ(received.back(),
+                  "key G" + std::to_string(G13::G13_EVENT_QUEUE + extra - 1) + " down");
+        EXPECT_THAT(Dump(subscriber), testing::HasSubstr("sent=256 dropped=10"));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(G13Events, partly_written_events_are_finished_before_dropping) {
+    const size_t size = 5000;  // larger than PIPE_BUF, so writes may be partial
+    auto event = [size](size_t i) {
+        auto text = std::to_string(i) + " ";
+        text.resize(size - 1, (char)('a' + i % 26));
+        return text + "\n";
+    };
+    int fds[2];
+    ASSERT_EQ(pipe2(fds, O_NONBLOCK), 0);
+    {
+        G13::G13_EventSubscriber subscriber(fds[1], G13::G13_EVENT_OUT, false, true, false);
+        size_t first = 20, second = 300;
+        for (size_t i = 0; i < first; i++) {
+            subscriber.Push(G13::G13_EVENT_OUT, event(i));
+        }
+        EXPECT_TRUE(subscriber.Drain());
+        std::string written;
+        char buf[65536];
+        ssize_t n;
+        while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+            written.append(buf, n);
+        }
+        size_t partial = written.size() / size;
+        ASSERT_NE(written.size() % size, 0u);
+        ASSERT_LT(partial, first);
+
+        for (size_t i = first; i < first + second; i++) {
+            subscriber.Push(G13::G13_EVENT_OUT, event(i));
+        }
+        size_t dropped = first - partial + second - G13::G13_EVENT_QUEUE;
+        auto received = DrainAll(subscriber, fds[0], false);
+        // the partial event is completed, those behind it were dropped
+        written.append(received.empty() ? "" : received.front() + "\n");
+        EXPECT_EQ(written.substr(partial * size), event(partial));
+        ASSERT_EQ(received.size(), G13::G13_EVENT_QUEUE);
+        for (size_t i = 1; i < received.size(); i++) {
+            EXPECT_EQ(received[i] + "\n", event(partial + dropped + i));
+        }
+        EXPECT_THAT(Dump(subscriber),
+                    testing::HasSubstr("dropped=" + std::to_string(dropped)));
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(G13Events, subscribers_get_the_types_they_asked_for) {
+    int keys[2], others[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, keys), 0);
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0, others), 0);
+    {
+        G13::G13_EventBus bus;
+        auto& key_subscriber = bus.Subscribe(keys[0], G13::G13_EVENT_KEY, true, false, false);
+        auto& other_subscriber = bus.Subscribe(
+            others[0], G13::G13_EVENT_PROFILE | G13::G13_EVENT_OUT, true, true, false);
+        bus.Publish(G13::G13_EVENT_KEY, "G1 down");
+        bus.Publish(G13::G13_EVENT_PROFILE, "game");
+        bus.Publish(G13::G13_EVENT_OUT, "hello");
+        bus.Flush();
+        EXPECT_THAT(DrainAll(key_subscriber, keys[1], true),
+                    testing::ElementsAre("key G1 down"));
+        EXPECT_THAT(DrainAll(other_subscriber, others[1], true),
+                    testing::ElementsAre("game", "hello"));
+    }
+    for (int fd : {keys[0], keys[1], others[0], others[1]}) {
+        close(fd);
+    }
+}
+
+using KeyEvents = std::vector<std::pair<int, int>>;
+
+TEST(G13KeyActions, repeated_keys_are_tapped_again) {
+    PipeDevice device;
+    auto action = device.MakeAction("A+A");
+    action->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 1}, {KEY_A, 0}, {KEY_A, 1}}));
+    action->act(false);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 0}}));
+}
+
+TEST(G13KeyActions, down_up_sequences_are_complete_taps) {
+    PipeDevice device;
+    auto action = device.MakeAction("LEFTCTRL+A B");
+    action->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_LEFTCTRL, 1}, {KEY_A, 1},
+                                            {KEY_A, 0}, {KEY_LEFTCTRL, 0}}));
+    action->act(false);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_B, 1}, {KEY_B, 0}}));
+}
+
+TEST(G13KeyActions, shared_modifiers_stay_down_until_the_last_release) {
+    PipeDevice device;
+    auto first = device.MakeAction("LEFTSHIFT+A");
+    auto second = device.MakeAction("LEFTSHIFT+B");
+    first->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_LEFTSHIFT, 1}, {KEY_A, 1}}));
+    second->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_B, 1}}));
+    first->act(false);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 0}}));
+    second->act(false);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_B, 0}, {KEY_LEFTSHIFT, 0}}));
+    // a release without a press sends nothing
+    second->act(false);
+    EXPECT_TRUE(device.TakeKeys().empty());
+}
+
+TEST(G13KeyActions, forced_releases_let_go_of_held_keys) {
+    PipeDevice device;
+    auto hold = device.MakeAction("A");
+    auto force = device.MakeAction("-A");
+    hold->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 1}}));
+    force->act(true);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 0}}));
+    force->act(false);
+    hold->act(false);
+    EXPECT_TRUE(device.TakeKeys().empty());
+}
+
+TEST(G13Commands, lookup_matches_whole_names_only) {
+    using G13::G13_Device;
+    ASSERT_NE(G13_Device::FindCommand("arc"), nullptr);
+    EXPECT_EQ(G13_Device::FindCommand("arc")->name, "arc");
+    EXPECT_EQ(G13_Device::FindCommand("widget")->name, "widget");
+    EXPECT_EQ(G13_Device::FindCommand("rgb")->name, "rgb");
+    EXPECT_EQ(G13_Device::FindCommand("rgbfx")->name, "rgbfx");
+    for (auto name : {"", "a", "rg", "rgbf", "rgbfxx", "zzz", "RGB"}) {
+        EXPECT_EQ(G13_Device::FindCommand(name), nullptr) << name;
+    }
+}
+
+TEST(G13Commands, compiled_commands_are_checked_once_and_run_later) {
+    PipeDevice device;
+    auto rgb = device.CompileCommand("rgb 10 20 30");
+    EXPECT_EQ(device.key_color().red, 0);
+    rgb();
+    EXPECT_EQ(device.key_color(), (G13::G13_Color{10, 20, 30}));
+    EXPECT_THROW(device.CompileCommand("rgb 10 twenty 30"), G13::G13_CommandException);
+    EXPECT_THROW(device.CompileCommand("nosuchcommand"), G13::G13_CommandException);
+    EXPECT_THROW(device.MakeAction("!nosuchcommand"), G13::G13_CommandException);
+}
+
+TEST(G13Commands, rgbfx_times_are_limited) {
+    PipeDevice device;
+    EXPECT_THROW(device.CompileCommand("rgbfx breathe 255 0 0 5000000000"),
+                 G13::G13_CommandException);
+    EXPECT_THROW(device.CompileCommand("rgbfx blink 255 0 0 100 3600001"),
+                 G13::G13_CommandException);
+    EXPECT_NO_THROW(device.CompileCommand("rgbfx fade 255 0 0 3600000"));
+}
+
+TEST(G13Commands, rgbfx_rate_has_its_own_range) {
+    PipeDevice device;
+    for (auto rate : {"0", "1001", "fast"}) {
+        try {
+            device.CompileCommand((std::string("rgbfx rate ") + rate).c_str());
+            ADD_FAILURE() << rate;
+        } catch (const G13::G13_CommandException& ex) {
+            EXPECT_THAT(ex.what(), testing::HasSubstr("rate")) << rate;
+        }
+    }
+    EXPECT_NO_THROW(device.CompileCommand("rgbfx rate 1000"));
+}
+
+TEST(G13Commands, drawing_is_limited_and_clipped) {
+    PipeDevice device;
+    EXPECT_THROW(device.Run("arc 0 0 1000000000 0 360"), G13::G13_CommandException);
+    EXPECT_THROW(device.Run("circle 0 0 257"), G13::G13_CommandException);
+    EXPECT_THROW(device.Run("line 0 0 2000000000 1"), G13::G13_CommandException);
+    device.lcd().image_clear();
+    device.Run("line -1024 0 1024 0");
+    device.Run("line 5 -1024 5 1024");
+    size_t pixels = 0;
+    for (size_t i = 0; i < G13::G13_LCD_BUF_SIZE; i++) {
+        pixels += __builtin_popcount(device.lcd().image_buf[i]);
+    }
+    EXPECT_EQ(pixels, G13::G13_LCD_COLUMNS + G13::G13_LCD_ROWS - 1);
+}
+
+// the position computation the zone tables stand in for
+struct StickMath : public G13::G13_Stick {
+    using G13_Stick::Normalize;
+};
+
+static size_t CountKeys(const KeyEvents& keys, int code) {
+    return std::count_if(keys.begin(), keys.end(),
+                         [code](const std::pair<int, int>& key) { return key.first == code; });
+}
+
+// Z1 sending A, its right edge between raw x 152 and 153 when centered
+static void AddTestZone(PipeDevice& device) {
+    device.Run("stickzone add Z1");
+    device.Run("stickzone bounds Z1 0.3 0.3 0.6 0.7");
+    device.Run("stickzone action Z1 KEY_A");
+}
+
+TEST(G13Stick, zone_tables_match_the_bounds) {
+    PipeDevice device;
+    AddTestZone(device);
+    std::vector<std::string> names{"STICK_UP",     "STICK_DOWN",     "STICK_LEFT", "STICK_RIGHT",
+                                   "STICK_PAGEUP", "STICK_PAGEDOWN", "Z1"};
+    auto check = [&](int center_x, int center_y) {
+        size_t mismatches = 0;
+        for (int x = 0; x < 256; x++) {
+            for (int y = 0; y < 256; y++) {
+                device.MoveStick(x, y);
+                G13::G13_ZoneCoord position(StickMath::Normalize(x, 0, center_x, 255),
+                                            StickMath::Normalize(y, 0, center_y, 255));
+                for (auto& name : names) {
+                    auto zone = device.stick().zone(name);
+                    mismatches += zone->active() != zone->bounds().contains(position);
+                }
+            }
+        }
+        device.TakeKeys();
+        return mismatches;
+    };
+    EXPECT_EQ(check(127, 127), 0u);
+    device.Run("stickmode CALCENTER");
+    device.MoveStick(100, 150);
+    device.Run("stickmode KEYS");
+    EXPECT_EQ(check(100, 150), 0u);
+    device.Run("stickzone del STICK_UP");
+    names.erase(names.begin());
+    EXPECT_EQ(check(100, 150), 0u);
+}
+
+TEST(G13Stick, zones_act_on_entering_and_leaving) {
+    PipeDevice device;
+    AddTestZone(device);
+    device.MoveStick(100, 110);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 1}}));
+    for (int i = 0; i < 10; i++) {
+        device.MoveStick(100 + i, 110);
+    }
+    EXPECT_TRUE(device.TakeKeys().empty());
+    device.MoveStick(200, 110);
+    EXPECT_EQ(device.TakeKeys(), (KeyEvents{{KEY_A, 0}}));
+
+    device.Run("stickzone repeat Z1 on");
+    for (int i = 0; i < 10; i++) {
+        device.MoveStick(100, 110);
+    }
+    auto keys = device.TakeKeys();
+    EXPECT_EQ(std::count(keys.begin(), keys.end(), std::make_pair(KEY_A, 1)), 10);
+}
+
+TEST(G13Stick, hysteresis_keeps_jitter_from_flapping_a_zone) {
+    PipeDevice device;
+    AddTestZone(device);
+    auto jitter = [&device]() {
+        device.MoveStick(100, 110);
+        device.TakeKeys();
+        for (int i = 0; i < 10; i++) {
+            device.MoveStick(i % 2 ? 152 : 153, 110);
+        }
+        return CountKeys(device.TakeKeys(), KEY_A);
+    };
+    EXPECT_EQ(jitter(), 10u);
+    device.Run("stickzone hysteresis Z1 0 0.05");
+    EXPECT_EQ(jitter(), 0u);
+
+    // with an enter margin of 0.05 the zone is entered left of x 0.55
+    device.Run("stickzone hysteresis Z1 0.05 0.05");
+    device.MoveStick(200, 110);
+    device.TakeKeys();
+    device.MoveStick(141, 110);
+    EXPECT_FALSE(device.stick().zone("Z1")->active());
+    device.MoveStick(139, 110);
+    EXPECT_TRUE(device.stick().zone("Z1")->active());
+    device.MoveStick(153, 110);
+    EXPECT_TRUE(device.stick().zone("Z1")->active());
+
+    EXPECT_THROW(device.Run("stickzone hysteresis Z1 0.2 0"), G13::G13_CommandException);
+    EXPECT_THROW(device.Run("stickzone hysteresis Z1 0.05"), G13::G13_CommandException);
+    EXPECT_THROW(device.Run("stickzone hysteresis Z1 -0.1 0"), G13::G13_CommandException);
+}
+
+TEST(G13Stick, no_zone_is_active_in_the_deadzone) {
+    PipeDevice device;
+    AddTestZone(device);
+    device.Run("stickdeadzone 0.1");
+    device.MoveStick(127, 127);
+    EXPECT_FALSE(device.stick().zone("Z1")->active());
+    // 0.125 from the center
+    device.MoveStick(100, 110);
+    EXPECT_TRUE(device.stick().zone("Z1")->active());
+    device.MoveStick(120, 120);
+    EXPECT_FALSE(device.stick().zone("Z1")->active());
+    device.Run("stickdeadzone 0");
+    device.MoveStick(127, 127);
+    EXPECT_TRUE(device.stick().zone("Z1")->active());
+    EXPECT_THROW(device.Run("stickdeadzone -1"), G13::G13_CommandException);
+}
+
 int main(int argc, char** argv) {
     ::testing::InitGoogleTest(&argc, argv);
 
@@ -73,4 +621,4 @@ int main(int argc, char** argv) {
     //
 
     return returnValue;
-}
\ No newline at end of file
+}